@@ -0,0 +1,370 @@
+#pragma once
+
+#include <image.hpp>
+#include <io.hpp>
+#include <mapped_file.hpp>
+#include <thread_pool.hpp>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Lossless frame archives for long acquisitions: an archive_header, then one record per
+// frame, then an index of frame offsets and an archive_footer. A frame record is the
+// compressed size of each tile followed by the tiles. Tiles are coded independently, so a
+// frame encodes and decodes one tile range per thread, and the index gives random access
+// to any frame.
+//
+// Each tile is predicted with the LOCO-I median edge detector, residuals are zigzag
+// mapped to unsigned, and every block of residuals is bit-packed at the width of its
+// largest value. Noise dominated detector data costs little more than its noise bits.
+namespace ko::io {
+  struct archive_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bit_depth;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t reserved;
+  };
+  static_assert(sizeof(archive_header) == 40);
+
+  struct archive_footer {
+    uint64_t index_offset;
+    uint64_t frame_count;
+    char magic[8];
+  };
+  static_assert(sizeof(archive_footer) == 24);
+
+  inline constexpr char archive_magic[8] = {'K', 'O', 'A', 'R', 'C', 'H', 'V', '\0'};
+  inline constexpr uint32_t archive_version = 1;
+
+  struct archive_options {
+    uint32_t tile_width = 128;
+    uint32_t tile_height = 64;
+  };
+
+  namespace archive_detail {
+    inline constexpr size_t block_size = 32;
+
+    // Tile at index in a row-major grid of tiles over a width x height frame.
+    struct tile_rect {
+      size_t x, y, width, height;
+    };
+
+    inline tile_rect tile_at(const archive_header& header, size_t index) {
+      const size_t across = (header.width + header.tile_width - 1) / header.tile_width;
+      const size_t x = index % across * header.tile_width;
+      const size_t y = index / across * header.tile_height;
+      return {x, y, std::min<size_t>(header.tile_width, header.width - x), std::min<size_t>(header.tile_height, header.height - y)};
+    }
+
+    inline size_t tile_count(const archive_header& header) {
+      return ((header.width + header.tile_width - 1) / header.tile_width) * ((header.height + header.tile_height - 1) / header.tile_height);
+    }
+
+    // Median edge detector; a, b and c are the left, upper and upper left neighbours.
+    inline int predict(int a, int b, int c) {
+      if (c >= std::max(a, b)) return std::min(a, b);
+      if (c <= std::min(a, b)) return std::max(a, b);
+      return a + b - c;
+    }
+
+    inline uint32_t zigzag(int r) { return (static_cast<uint32_t>(r) << 1) ^ static_cast<uint32_t>(r >> 31); }
+    inline int unzigzag(uint32_t u) { return static_cast<int>(u >> 1) ^ -static_cast<int>(u & 1); }
+
+    // Compiles to a single load on little-endian targets.
+    inline uint64_t load_le64(const std::byte* p) {
+      uint64_t value = 0;
+      for (int k = 0; k < 8; ++k) value |= std::to_integer<uint64_t>(p[k]) << (8 * k);
+      return value;
+    }
+
+    inline size_t packed_bytes(size_t n, int bits) { return (n * bits + 7) / 8; }
+
+    // Appends a bit width byte and n values packed LSB first at that width.
+    inline void pack_block(const uint32_t* values, size_t n, std::vector<std::byte>& out) {
+      uint32_t any = 0;
+      for (size_t i = 0; i < n; ++i) any |= values[i];
+      const int bits = std::bit_width(any);
+      const size_t start = out.size();
+      out.resize(start + 1 + packed_bytes(n, bits));
+      std::byte* p = out.data() + start;
+      *p++ = static_cast<std::byte>(bits);
+      uint64_t acc = 0;
+      int filled = 0;
+      for (size_t i = 0; i < n; ++i) {
+        acc |= uint64_t(values[i]) << filled;
+        filled += bits;
+        if (filled >= 32) {
+          for (int k = 0; k < 4; ++k, acc >>= 8) *p++ = static_cast<std::byte>(acc);
+          filled -= 32;
+        }
+      }
+      for (; filled > 0; filled -= 8, acc >>= 8) *p++ = static_cast<std::byte>(acc);
+    }
+
+    // Reads n values of a block packed at bits from p, with size bytes available.
+    inline void unpack_block(const std::byte* p, size_t size, int bits, size_t n, uint32_t* values) {
+      const uint64_t mask = (uint64_t(1) << bits) - 1;
+      for (size_t i = 0; i < n; ++i) {
+        const size_t bit = i * bits;
+        const size_t byte = bit / 8;
+        uint64_t word;
+        if (byte + 8 <= size) {
+          word = load_le64(p + byte);
+        } else {
+          word = 0;
+          for (size_t k = byte; k < size; ++k) word |= std::to_integer<uint64_t>(p[k]) << (8 * (k - byte));
+        }
+        values[i] = static_cast<uint32_t>((word >> (bit % 8)) & mask);
+      }
+    }
+
+    // Residuals are computed from the tile's own pixels only, so tiles are independent.
+    template<typename T>
+    void encode_tile(const T* src, size_t pitch, const tile_rect& tile, std::vector<uint32_t>& residuals, std::vector<std::byte>& out) {
+      residuals.resize(tile.width * tile.height);
+      uint32_t* r = residuals.data();
+      const T* row = src + tile.y * pitch + tile.x;
+      r[0] = zigzag(row[0]);
+      for (size_t x = 1; x < tile.width; ++x) r[x] = zigzag(int(row[x]) - row[x - 1]);
+      for (size_t y = 1; y < tile.height; ++y) {
+        const T* up = row;
+        row += pitch;
+        r += tile.width;
+        r[0] = zigzag(int(row[0]) - up[0]);
+        for (size_t x = 1; x < tile.width; ++x) r[x] = zigzag(int(row[x]) - predict(row[x - 1], up[x], up[x - 1]));
+      }
+      out.clear();
+      for (size_t i = 0; i < residuals.size(); i += block_size) {
+        pack_block(residuals.data() + i, std::min(block_size, residuals.size() - i), out);
+      }
+    }
+
+    template<typename T>
+    void decode_tile(const std::byte* data, size_t size, T* dst, size_t pitch, const tile_rect& tile, std::vector<uint32_t>& residuals) {
+      residuals.resize(tile.width * tile.height);
+      size_t pos = 0;
+      for (size_t i = 0; i < residuals.size(); i += block_size) {
+        const size_t n = std::min(block_size, residuals.size() - i);
+        if (pos >= size) throw std::runtime_error("Corrupt archive: truncated tile");
+        const int bits = std::to_integer<int>(data[pos++]);
+        if (bits > 32 || pos + packed_bytes(n, bits) > size) throw std::runtime_error("Corrupt archive: bad block");
+        unpack_block(data + pos, size - pos, bits, n, residuals.data() + i);
+        pos += packed_bytes(n, bits);
+      }
+      const uint32_t* r = residuals.data();
+      T* row = dst + tile.y * pitch + tile.x;
+      row[0] = static_cast<T>(unzigzag(r[0]));
+      for (size_t x = 1; x < tile.width; ++x) row[x] = static_cast<T>(unzigzag(r[x]) + row[x - 1]);
+      for (size_t y = 1; y < tile.height; ++y) {
+        const T* up = row;
+        row += pitch;
+        r += tile.width;
+        row[0] = static_cast<T>(unzigzag(r[0]) + up[0]);
+        for (size_t x = 1; x < tile.width; ++x) row[x] = static_cast<T>(unzigzag(r[x]) + predict(row[x - 1], up[x], up[x - 1]));
+      }
+    }
+  }
+
+  template<typename T>
+  class archive_writer {
+    static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>);
+
+    std::ofstream file_;
+    archive_header header_;
+    std::vector<uint64_t> index_;
+    uint64_t position_ = sizeof(archive_header);
+    std::vector<std::vector<std::byte>> tiles_;
+    host_view<T> staging_;
+    ko::concurrency::thread_pool& pool_;
+
+  public:
+    archive_writer(const std::string& path, size_t width, size_t height, uint32_t bit_depth = 8 * sizeof(T),
+                   archive_options options = {}, ko::concurrency::thread_pool& pool = io_pool())
+      : file_(path, std::ios::binary | std::ios::trunc), header_{}, pool_(pool) {
+      if (!file_) throw std::runtime_error("Failed to open: " + path);
+      if ((bit_depth <= 8 ? 1 : 2) != sizeof(T) || bit_depth > 16) throw std::runtime_error("Bit depth doesn't match element type");
+      if (options.tile_width == 0 || options.tile_height == 0) throw std::invalid_argument("Archive tiles must not be empty");
+      if (width == 0 || height == 0) throw std::invalid_argument("Archive frames must not be empty");
+      if (width > UINT32_MAX || height > UINT32_MAX) throw std::invalid_argument("Archive frame too large");
+      std::memcpy(header_.magic, archive_magic, sizeof(archive_magic));
+      header_.version = archive_version;
+      header_.header_size = sizeof(archive_header);
+      header_.width = width;
+      header_.height = height;
+      header_.bit_depth = bit_depth;
+      header_.tile_width = std::min<size_t>(options.tile_width, width);
+      header_.tile_height = std::min<size_t>(options.tile_height, height);
+      tiles_.resize(archive_detail::tile_count(header_));
+      if constexpr (!mat_compatible<T>) {
+        staging_ = host_view<T>(Kokkos::view_alloc(Kokkos::WithoutInitializing, "archive_writer staging"), width, height);
+      }
+      file_.write(reinterpret_cast<const char*>(&header_), sizeof(archive_header));
+    }
+
+    archive_writer(const archive_writer&) = delete;
+    archive_writer& operator=(const archive_writer&) = delete;
+
+    ~archive_writer() {
+      if (file_.is_open()) close();
+    }
+
+    size_t frame_count() const { return index_.size(); }
+    uint64_t bytes_written() const { return position_; }
+
+    // Compresses one frame from host memory, pitch elements between rows.
+    void write(const T* src, size_t pitch) {
+      const size_t tiles = tiles_.size();
+      const size_t tasks = std::min(tiles, 4 * pool_.size());
+      pool_.parallel_for(tasks, [&](size_t task) {
+        std::vector<uint32_t> residuals;
+        for (size_t i = task * tiles / tasks; i < (task + 1) * tiles / tasks; ++i) {
+          archive_detail::encode_tile(src, pitch, archive_detail::tile_at(header_, i), residuals, tiles_[i]);
+        }
+      });
+
+      std::vector<uint32_t> sizes(tiles);
+      for (size_t i = 0; i < tiles; ++i) sizes[i] = static_cast<uint32_t>(tiles_[i].size());
+      index_.push_back(position_);
+      file_.write(reinterpret_cast<const char*>(sizes.data()), sizes.size() * sizeof(uint32_t));
+      position_ += sizes.size() * sizeof(uint32_t);
+      for (const auto& tile : tiles_) {
+        file_.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+        position_ += tile.size();
+      }
+      if (!file_) throw std::runtime_error("Failed to write archive frame");
+    }
+
+    void write(const ko::image::image_2d<T> frame) {
+      if (frame.width() != header_.width || frame.height() != header_.height) throw std::runtime_error("Frame size doesn't match archive");
+      if constexpr (mat_compatible<T>) {
+        Kokkos::fence();
+        auto data = frame.data();
+        write(data.data(), data.stride(1));
+      } else {
+        copy_to_host(staging_, frame);
+        write(staging_.data(), staging_.stride(1));
+      }
+    }
+
+    void close() {
+      archive_footer footer{position_, index_.size(), {}};
+      std::memcpy(footer.magic, archive_magic, sizeof(archive_magic));
+      file_.write(reinterpret_cast<const char*>(index_.data()), index_.size() * sizeof(uint64_t));
+      file_.write(reinterpret_cast<const char*>(&footer), sizeof(archive_footer));
+      file_.close();
+    }
+  };
+
+  template<typename T>
+  class archive_reader {
+    static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>);
+
+    mapped_file file_;
+    archive_header header_;
+    std::vector<uint64_t> index_;
+    host_view<T> staging_;
+    ko::concurrency::thread_pool& pool_;
+
+    size_t tile_count() const { return archive_detail::tile_count(header_); }
+
+    // Compressed size of each tile of a frame. Frame records are byte packed, so the table
+    // is copied out rather than read in place.
+    std::vector<uint32_t> tile_sizes(size_t index) const {
+      if (index >= index_.size()) throw std::out_of_range("Archive frame index out of range");
+      std::vector<uint32_t> sizes(tile_count());
+      std::memcpy(sizes.data(), file_.data() + index_[index], sizes.size() * sizeof(uint32_t));
+      return sizes;
+    }
+
+  public:
+    explicit archive_reader(const std::string& path, ko::concurrency::thread_pool& pool = io_pool())
+      : file_(path), pool_(pool) {
+      if (file_.size() < sizeof(archive_header) + sizeof(archive_footer)) throw std::runtime_error("Not a frame archive: " + path);
+      std::memcpy(&header_, file_.data(), sizeof(archive_header));
+      archive_footer footer;
+      std::memcpy(&footer, file_.data() + file_.size() - sizeof(archive_footer), sizeof(archive_footer));
+      if (std::memcmp(header_.magic, archive_magic, sizeof(archive_magic)) != 0 || header_.version != archive_version) {
+        throw std::runtime_error("Not a frame archive: " + path);
+      }
+      if (std::memcmp(footer.magic, archive_magic, sizeof(archive_magic)) != 0) throw std::runtime_error("Unterminated frame archive: " + path);
+      if ((header_.bit_depth <= 8 ? 1 : 2) != sizeof(T)) throw std::runtime_error("Archive bit depth doesn't match element type: " + path);
+      if (header_.width == 0 || header_.height == 0 || header_.tile_width == 0 || header_.tile_height == 0) {
+        throw std::runtime_error("Corrupt frame archive header: " + path);
+      }
+      if (tile_count() > file_.size() / sizeof(uint32_t) || footer.frame_count > file_.size() / sizeof(uint64_t) ||
+          footer.index_offset > file_.size() ||
+          footer.index_offset + footer.frame_count * sizeof(uint64_t) + sizeof(archive_footer) != file_.size()) {
+        throw std::runtime_error("Corrupt frame archive index: " + path);
+      }
+      index_.resize(footer.frame_count);
+      std::memcpy(index_.data(), file_.data() + footer.index_offset, index_.size() * sizeof(uint64_t));
+      for (uint64_t offset : index_) {
+        if (offset > footer.index_offset || offset + tile_count() * sizeof(uint32_t) > footer.index_offset) throw std::runtime_error("Corrupt frame archive index: " + path);
+      }
+      if constexpr (!mat_compatible<T>) {
+        staging_ = host_view<T>(Kokkos::view_alloc(Kokkos::WithoutInitializing, "archive_reader staging"), header_.width, header_.height);
+      }
+    }
+
+    size_t width() const { return header_.width; }
+    size_t height() const { return header_.height; }
+    size_t bit_depth() const { return header_.bit_depth; }
+    size_t frame_count() const { return index_.size(); }
+
+    size_t compressed_bytes(size_t index) const {
+      const auto sizes = tile_sizes(index);
+      size_t bytes = tile_count() * sizeof(uint32_t);
+      for (size_t i = 0; i < tile_count(); ++i) bytes += sizes[i];
+      return bytes;
+    }
+
+    // Decompresses a frame into host memory, pitch elements between rows.
+    void read(size_t index, T* dst, size_t pitch) const {
+      const auto sizes = tile_sizes(index);
+      const size_t tiles = tile_count();
+      std::vector<uint64_t> offsets(tiles);
+      uint64_t offset = index_[index] + tiles * sizeof(uint32_t);
+      for (size_t i = 0; i < tiles; ++i) {
+        offsets[i] = offset;
+        offset += sizes[i];
+      }
+      if (offset > file_.size()) throw std::runtime_error("Corrupt archive: frame runs past end of file");
+      const size_t tasks = std::min(tiles, 4 * pool_.size());
+      pool_.parallel_for(tasks, [&](size_t task) {
+        std::vector<uint32_t> residuals;
+        for (size_t i = task * tiles / tasks; i < (task + 1) * tiles / tasks; ++i) {
+          archive_detail::decode_tile(file_.data() + offsets[i], sizes[i], dst, pitch, archive_detail::tile_at(header_, i), residuals);
+        }
+      });
+    }
+
+    void read_frame(size_t index, ko::image::image_2d<T> dst) {
+      if (dst.width() != header_.width || dst.height() != header_.height) throw std::runtime_error("Frame size doesn't match archive");
+      if constexpr (mat_compatible<T>) {
+        auto data = dst.data();
+        Kokkos::fence();
+        read(index, data.data(), data.stride(1));
+      } else {
+        read(index, staging_.data(), staging_.stride(1));
+        copy_from_host(dst, staging_);
+      }
+    }
+
+    ko::image::image_2d<T> frame(size_t index) {
+      ko::image::image_2d<T> image(header_.width, header_.height);
+      read_frame(index, image);
+      return image;
+    }
+  };
+}
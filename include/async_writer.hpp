@@ -0,0 +1,157 @@
+#pragma once
+
+#include <image.hpp>
+#include <io.hpp>
+#include <thread_pool.hpp>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace ko::io {
+  struct writer_stats {
+    size_t written = 0;
+    size_t failed = 0;
+    size_t stalls = 0;     // acquire() calls that had to wait for a buffer
+    size_t rejected = 0;   // try_acquire() calls that found none
+    size_t in_flight = 0;  // submitted, not yet on disk
+  };
+
+  // Frame buffer owned by an async_writer between acquire and submit.
+  template<typename T>
+  struct writer_frame {
+    size_t slot;
+    ko::image::image_2d<T> image;
+  };
+
+  // Encodes and writes frames on a background pool. The writer owns a fixed set of frame
+  // buffers: the caller acquires one, fills it, and submits it with a path, after which the
+  // buffer belongs to the writer until it is on disk and back on the free list. When the
+  // disk falls behind the free list runs dry, which acquire() counts as a stall and
+  // try_acquire() reports by returning nothing. The copy to the host buffer, where one
+  // is needed, runs on the pool on the writer's own execution space instance.
+  template<typename T>
+  class async_writer {
+    std::vector<std::unique_ptr<mat_image<T>>> buffers_;
+    std::vector<size_t> free_;
+    std::vector<int> params_;
+    Kokkos::DefaultExecutionSpace copy_space_;
+    writer_stats stats_;
+    std::exception_ptr error_;
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+    ko::concurrency::thread_pool pool_;
+
+    void release(size_t slot, std::exception_ptr error) {
+      {
+        std::lock_guard lock(mutex_);
+        free_.push_back(slot);
+        stats_.in_flight -= 1;
+        if (error) {
+          stats_.failed += 1;
+          if (!error_) error_ = error;
+        } else {
+          stats_.written += 1;
+        }
+      }
+      released_.notify_all();
+    }
+
+    writer_frame<T> take(size_t slot) {
+      return {slot, buffers_[slot]->image()};
+    }
+
+  public:
+    async_writer(size_t width, size_t height, size_t buffers = 4, size_t threads = 2, std::vector<int> params = {})
+      : params_(std::move(params)),
+        copy_space_(Kokkos::Experimental::partition_space(Kokkos::DefaultExecutionSpace(), 1)[0]),
+        pool_(threads) {
+      for (size_t i = 0; i < buffers; ++i) {
+        buffers_.push_back(std::make_unique<mat_image<T>>(width, height));
+        free_.push_back(i);
+      }
+    }
+
+    async_writer(const async_writer&) = delete;
+    async_writer& operator=(const async_writer&) = delete;
+
+    ~async_writer() {
+      std::unique_lock lock(mutex_);
+      released_.wait(lock, [this] { return stats_.in_flight == 0; });
+    }
+
+    writer_frame<T> acquire() {
+      std::unique_lock lock(mutex_);
+      if (free_.empty()) {
+        stats_.stalls += 1;
+        released_.wait(lock, [this] { return !free_.empty(); });
+      }
+      const size_t slot = free_.back();
+      free_.pop_back();
+      return take(slot);
+    }
+
+    std::optional<writer_frame<T>> try_acquire() {
+      std::lock_guard lock(mutex_);
+      if (free_.empty()) {
+        stats_.rejected += 1;
+        return std::nullopt;
+      }
+      const size_t slot = free_.back();
+      free_.pop_back();
+      return take(slot);
+    }
+
+    // Hands frame to the writer without blocking. Work filling the frame's image must be
+    // queued on space; the pool waits for that instance, not the whole device.
+    void submit(writer_frame<T> frame, std::string path, const Kokkos::DefaultExecutionSpace& space = {}) {
+      {
+        std::lock_guard lock(mutex_);
+        stats_.in_flight += 1;
+      }
+      pool_.submit([this, slot = frame.slot, path = std::move(path), space] {
+        std::exception_ptr error;
+        try {
+          space.fence();
+          buffers_[slot]->to_mat(copy_space_);
+          write_mat(path, buffers_[slot]->mat(), params_);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        release(slot, error);
+      });
+    }
+
+    // Copies image into a writer buffer, waiting for one if needed, and submits it.
+    void write(const ko::image::image_2d<T> image, std::string path, const Kokkos::DefaultExecutionSpace& space = {}) {
+      auto frame = acquire();
+      Kokkos::deep_copy(space, frame.image.data(), image.data());
+      submit(frame, std::move(path), space);
+    }
+
+    // Waits for every submitted frame and rethrows the first write failure since the last
+    // flush.
+    void flush() {
+      std::unique_lock lock(mutex_);
+      released_.wait(lock, [this] { return stats_.in_flight == 0; });
+      if (error_) {
+        auto error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+      }
+    }
+
+    writer_stats stats() const {
+      std::lock_guard lock(mutex_);
+      return stats_;
+    }
+
+    bool backlogged() const {
+      std::lock_guard lock(mutex_);
+      return free_.empty();
+    }
+  };
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <image.hpp>
+#include <detector.hpp>
+#include <io.hpp>
+#include <frame_sequence.hpp>
+#include <async_writer.hpp>
+#include <thread_pool.hpp>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reprocessing of archived frames in one process: frames are decoded ahead on a pool,
+// corrected on the device, and encoded and written on the writer's own pool, so reading
+// frame i + 1 and writing frame i - 1 overlap the correction of frame i.
+namespace ko::batch {
+  struct batch_settings {
+    std::vector<std::string> inputs;
+    std::string output_dir;
+    std::string dark_path;
+    std::string gain_path;
+    std::string defect_path;
+    std::string timing_log;            // per-frame CSV, skipped when empty
+    ko::detector::detector_settings<uint16_t> detector;
+    bool equalise = false;
+    size_t decode_threads = std::max(2u, std::thread::hardware_concurrency() / 2);
+    size_t encode_threads = 2;
+    size_t write_buffers = 4;
+  };
+
+  struct frame_timing {
+    std::string input;
+    std::string output;
+    double read_ms = 0;     // waiting for the decoded frame and uploading it
+    double process_ms = 0;
+    double write_ms = 0;    // handing the frame to the writer, including stalls
+    std::string error;
+  };
+
+  struct batch_report {
+    size_t processed = 0;
+    size_t failed = 0;
+    double seconds = 0;
+    ko::io::writer_stats writes;
+  };
+
+  // The image files in a directory in name order, the lines of a .txt or .lst file list,
+  // or the path itself.
+  inline std::vector<std::string> collect_inputs(const std::string& path) {
+    namespace fs = std::filesystem;
+    std::vector<std::string> inputs;
+    if (fs::is_directory(path)) {
+      for (const auto& entry : fs::directory_iterator(path)) {
+        if (!entry.is_regular_file()) continue;
+        auto extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (extension == ".tif" || extension == ".tiff" || extension == ".png") inputs.push_back(entry.path().string());
+      }
+      std::sort(inputs.begin(), inputs.end());
+    } else if (fs::path(path).extension() == ".txt" || fs::path(path).extension() == ".lst") {
+      std::ifstream list(path);
+      if (!list) throw std::runtime_error("Failed to open: " + path);
+      for (std::string line; std::getline(list, line);) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty() && line.front() != '#') inputs.push_back(line);
+      }
+    } else {
+      inputs.push_back(path);
+    }
+    return inputs;
+  }
+
+  // Quoted CSV field, with embedded quotes doubled as RFC 4180 asks.
+  inline std::string csv_quoted(const std::string& field) {
+    std::string quoted = "\"";
+    for (char c : field) {
+      if (c == '"') quoted += '"';
+      quoted += c;
+    }
+    return quoted + '"';
+  }
+
+  inline void write_timing_log(const std::string& path, const std::vector<frame_timing>& timings) {
+    std::ofstream log(path);
+    if (!log) throw std::runtime_error("Failed to open: " + path);
+    log << "frame,input,output,read_ms,process_ms,write_ms,error\n";
+    for (size_t i = 0; i < timings.size(); ++i) {
+      const auto& t = timings[i];
+      log << std::format("{},{},{},{:.3f},{:.3f},{:.3f},{}\n", i, csv_quoted(t.input), csv_quoted(t.output), t.read_ms, t.process_ms, t.write_ms, csv_quoted(t.error));
+    }
+  }
+
+  // Corrects every input with one calibrated detector. A frame that fails to decode or
+  // doesn't match the calibration is logged and skipped; write failures are counted in
+  // the report.
+  inline batch_report run_batch(const batch_settings& settings) {
+    using clock = std::chrono::steady_clock;
+    auto ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    if (settings.inputs.empty()) throw std::runtime_error("No input frames");
+    std::filesystem::create_directories(settings.output_dir);
+
+    ko::detector::calibrated_detector<uint16_t> detector(
+      ko::io::read_image(settings.dark_path),
+      ko::io::read_image(settings.gain_path),
+      ko::io::read_image(settings.defect_path),
+      settings.detector);
+
+    ko::concurrency::thread_pool decoders(settings.decode_threads);
+    ko::io::frame_stream<uint16_t> stream(ko::io::page_source::files(settings.inputs), decoders);
+    ko::io::async_writer<uint16_t> writer(detector.width(), detector.height(), settings.write_buffers, settings.encode_threads);
+    ko::image::image_2d<uint16_t> frame(detector.width(), detector.height());
+
+    std::vector<frame_timing> timings(settings.inputs.size());
+    batch_report report;
+    const auto start = clock::now();
+    for (size_t i = 0; i < settings.inputs.size(); ++i) {
+      auto& timing = timings[i];
+      timing.input = settings.inputs[i];
+      timing.output = (std::filesystem::path(settings.output_dir) / std::filesystem::path(timing.input).filename()).string();
+      try {
+        auto t0 = clock::now();
+        stream.next(frame);
+        Kokkos::fence();
+        auto t1 = clock::now();
+        detector.correct(frame);
+        if (settings.equalise) detector.equalise(frame);
+        Kokkos::fence();
+        auto t2 = clock::now();
+        writer.write(frame, timing.output);
+        auto t3 = clock::now();
+        timing.read_ms = ms(t1 - t0);
+        timing.process_ms = ms(t2 - t1);
+        timing.write_ms = ms(t3 - t2);
+        report.processed += 1;
+      } catch (const std::exception& e) {
+        timing.error = e.what();
+        report.failed += 1;
+      }
+    }
+
+    try {
+      writer.flush();
+    } catch (const std::exception&) {
+      // Counted in writer stats.
+    }
+    report.seconds = std::chrono::duration<double>(clock::now() - start).count();
+    report.writes = writer.stats();
+    if (!settings.timing_log.empty()) write_timing_log(settings.timing_log, timings);
+    return report;
+  }
+}
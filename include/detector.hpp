@@ -0,0 +1,86 @@
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <packed.hpp>
+#include <transforms.hpp>
+#include <type_traits>
+
+namespace ko::detector {
+  template<typename T>
+  struct detector_settings {
+    T offset;
+    T min;
+    T max;
+    size_t defect_kernel_size = 7;
+    double defect_sigma = 1.0;
+    size_t histogram_size = 16384;
+    T equalisation_range = 256;
+    float lut_smoothing = 0.0f;
+  };
+
+  // Everything derived from a detector's calibration images, built once: the normalised
+  // gain in a compact encoding G, the defect plan and its kernel, and the equaliser's
+  // histogram and LUT. The dark is kept as T and the offset applied in registers by the
+  // fused correction, which costs nothing and keeps the dark's full range.
+  // correct() and equalise() then run the per-frame chain without allocating.
+  template<typename T, typename G = float>
+  class calibrated_detector {
+    detector_settings<T> settings_;
+    ko::image::image_2d<T> dark_;
+    ko::image::image_2d<G> gain_;
+    view<double**> defect_kernel_;
+    ko::transforms::defect_plan defect_plan_;
+    ko::transforms::histogram_equaliser<T> equaliser_;
+
+  public:
+    calibrated_detector(
+      ko::image::image_2d<T> dark,
+      ko::image::image_2d<T> gain,
+      ko::image::image_2d<T> defect_map,
+      detector_settings<T> settings
+    ) : settings_(settings),
+        dark_(dark),
+        gain_(gain.width(), gain.height()),
+        defect_kernel_(ko::transforms::gaussian_kernel(settings.defect_kernel_size, settings.defect_sigma)),
+        defect_plan_(ko::transforms::make_defect_plan(defect_map, defect_kernel_)),
+        equaliser_(settings.histogram_size, settings.min, settings.max, settings.equalisation_range, settings.lut_smoothing) {
+      ko::transforms::normalise(gain_, gain);
+    }
+
+    const detector_settings<T>& settings() const { return settings_; }
+    size_t width() const { return dark_.width(); }
+    size_t height() const { return dark_.height(); }
+    ko::image::image_2d<T> dark() const { return dark_; }
+    ko::image::image_2d<G> gain() const { return gain_; }
+    view<double**> defect_kernel() const { return defect_kernel_; }
+    const ko::transforms::defect_plan& defect_plan() const { return defect_plan_; }
+    ko::transforms::histogram_equaliser<T>& equaliser() { return equaliser_; }
+
+    // Dark, offset, gain and defect correction of frame, in place, on space.
+    void correct(ko::image::image_2d<T> frame, const Kokkos::DefaultExecutionSpace& space = {}) const {
+      assert(frame.width() == width() && frame.height() == height());
+      ko::transforms::flat_field_correction(frame, dark_, gain_, settings_.offset, settings_.min, settings_.max, space);
+      ko::transforms::defect_correction(frame, defect_plan_, space);
+    }
+
+    // Every frame of a stack, in one launch per step.
+    void correct(ko::image::image_3d<T> frames) const {
+      assert(frames.width() == width() && frames.height() == height());
+      ko::transforms::flat_field_correction(frames, dark_, gain_, settings_.offset, settings_.min, settings_.max);
+      ko::transforms::defect_correction(frames, defect_plan_);
+    }
+
+    // The same, unpacking raw into frame as part of the flat field correction.
+    void correct(const ko::packed::packed_frame& raw, ko::image::image_2d<T> frame, const Kokkos::DefaultExecutionSpace& space = {}) const
+    requires std::is_same_v<T, uint16_t> {
+      assert(frame.width() == width() && frame.height() == height());
+      ko::packed::flat_field_correction(raw, frame, dark_, gain_, settings_.offset, settings_.min, settings_.max, space);
+      ko::transforms::defect_correction(frame, defect_plan_, space);
+    }
+
+    void equalise(ko::image::image_2d<T> frame, bool reuse_previous_lut = false, const Kokkos::DefaultExecutionSpace& space = {}) {
+      equaliser_.equalise(frame, reuse_previous_lut, space);
+    }
+  };
+}
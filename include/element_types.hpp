@@ -0,0 +1,67 @@
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <type_traits>
+
+// Image element types beyond the built in arithmetic ones, and the types kernels
+// compute in for each element type.
+namespace ko::maths {
+  // Unsigned Q-format fixed point value. fixed_point<uint16_t, 14> is Q2.14: values in
+  // [0, 4) with a resolution of 2^-14, which covers normalised detector gains.
+  template<typename Storage, int FractionalBits>
+  struct fixed_point {
+    static_assert(std::is_unsigned_v<Storage> && FractionalBits < 8 * sizeof(Storage));
+    static constexpr int fractional_bits = FractionalBits;
+    static constexpr double scale = static_cast<double>(1ull << FractionalBits);
+
+    Storage raw = 0;
+
+    fixed_point() = default;
+
+    KOKKOS_INLINE_FUNCTION
+    explicit fixed_point(double value) {
+      const double max_raw = Kokkos::Experimental::finite_max_v<Storage>;
+      raw = static_cast<Storage>(Kokkos::clamp(value * scale + 0.5, 0.0, max_raw));
+    }
+
+    KOKKOS_INLINE_FUNCTION
+    explicit operator float() const { return raw * static_cast<float>(1.0 / scale); }
+
+    KOKKOS_INLINE_FUNCTION
+    explicit operator double() const { return raw * (1.0 / scale); }
+  };
+
+  using q2_14 = fixed_point<uint16_t, 14>;
+
+  // Type kernels do their arithmetic in for a given element type.
+  template<typename T>
+  struct arithmetic_type { using type = T; };
+
+  template<typename Storage, int FractionalBits>
+  struct arithmetic_type<fixed_point<Storage, FractionalBits>> { using type = float; };
+
+  // Half precision types halve the storage and bandwidth of intermediates that only need
+  // ~11 (half_t) or ~8 (bhalf_t) bits of mantissa; arithmetic on them is done in float.
+  // Where Kokkos has no native type for one it is an alias of float, and needs nothing.
+  template<typename T>
+  constexpr bool is_half_precision_v = false;
+
+#if defined(KOKKOS_HALF_T_IS_FLOAT) && !KOKKOS_HALF_T_IS_FLOAT
+  template<>
+  struct arithmetic_type<Kokkos::Experimental::half_t> { using type = float; };
+
+  template<>
+  constexpr bool is_half_precision_v<Kokkos::Experimental::half_t> = true;
+#endif
+
+#if defined(KOKKOS_BHALF_T_IS_FLOAT) && !KOKKOS_BHALF_T_IS_FLOAT
+  template<>
+  struct arithmetic_type<Kokkos::Experimental::bhalf_t> { using type = float; };
+
+  template<>
+  constexpr bool is_half_precision_v<Kokkos::Experimental::bhalf_t> = true;
+#endif
+
+  template<typename... Ts>
+  using compute_type_t = std::common_type_t<typename arithmetic_type<Ts>::type..., float>;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <element_types.hpp>
+#include <concepts>
+#include <type_traits>
+#include <utility>
+
+// Lazy per-pixel arithmetic on images. Operators on image_2d, scalars and other
+// expressions build a small tree of copyable nodes; nothing is computed until the tree is
+// assigned to an image_2d, which evaluates it in a single kernel with no temporaries.
+// Arithmetic follows the usual C++ promotions, so e.g. uint16 - uint16 is an int and
+// can't wrap before it is clamped.
+namespace ko::image {
+  template<typename E>
+  concept image_expression = requires { typename E::is_image_expression; };
+
+  // Pixels are read as their arithmetic type, so e.g. half precision and fixed point
+  // images are computed on in float.
+  template<typename V>
+  struct view_terminal {
+    using is_image_expression = void;
+    using value_type = typename ko::maths::arithmetic_type<typename V::non_const_value_type>::type;
+    static constexpr bool has_shape = true;
+
+    V data;
+
+    size_t width() const { return data.extent(0); }
+    size_t height() const { return data.extent(1); }
+
+    KOKKOS_INLINE_FUNCTION
+    value_type operator()(size_t x, size_t y) const { return static_cast<value_type>(data(x, y)); }
+  };
+
+  template<typename T>
+  struct scalar_terminal {
+    using is_image_expression = void;
+    using value_type = T;
+    static constexpr bool has_shape = false;
+
+    T value;
+
+    size_t width() const { return 0; }
+    size_t height() const { return 0; }
+
+    KOKKOS_INLINE_FUNCTION
+    value_type operator()(size_t, size_t) const { return value; }
+  };
+
+  template<typename Op, typename L, typename R>
+  struct binary_expression {
+    using is_image_expression = void;
+    using value_type = decltype(Op::apply(std::declval<typename L::value_type>(), std::declval<typename R::value_type>()));
+    static constexpr bool has_shape = L::has_shape || R::has_shape;
+
+    L lhs;
+    R rhs;
+
+    size_t width() const { return L::has_shape ? lhs.width() : rhs.width(); }
+    size_t height() const { return L::has_shape ? lhs.height() : rhs.height(); }
+
+    KOKKOS_INLINE_FUNCTION
+    value_type operator()(size_t x, size_t y) const { return Op::apply(lhs(x, y), rhs(x, y)); }
+  };
+
+  template<typename U, typename E>
+  struct cast_expression {
+    using is_image_expression = void;
+    using value_type = U;
+    static constexpr bool has_shape = E::has_shape;
+
+    E expr;
+
+    size_t width() const { return expr.width(); }
+    size_t height() const { return expr.height(); }
+
+    KOKKOS_INLINE_FUNCTION
+    value_type operator()(size_t x, size_t y) const { return static_cast<U>(expr(x, y)); }
+  };
+
+  template<typename E>
+  struct clamp_expression {
+    using is_image_expression = void;
+    using value_type = typename E::value_type;
+    static constexpr bool has_shape = E::has_shape;
+
+    E expr;
+    value_type lo;
+    value_type hi;
+
+    size_t width() const { return expr.width(); }
+    size_t height() const { return expr.height(); }
+
+    KOKKOS_INLINE_FUNCTION
+    value_type operator()(size_t x, size_t y) const { return Kokkos::clamp(expr(x, y), lo, hi); }
+  };
+
+  namespace ops {
+    struct plus {
+      template<typename A, typename B>
+      KOKKOS_INLINE_FUNCTION static auto apply(A a, B b) { return a + b; }
+    };
+
+    struct minus {
+      template<typename A, typename B>
+      KOKKOS_INLINE_FUNCTION static auto apply(A a, B b) { return a - b; }
+    };
+
+    struct multiplies {
+      template<typename A, typename B>
+      KOKKOS_INLINE_FUNCTION static auto apply(A a, B b) { return a * b; }
+    };
+
+    struct divides {
+      template<typename A, typename B>
+      KOKKOS_INLINE_FUNCTION static auto apply(A a, B b) { return a / b; }
+    };
+  }
+
+  // Anything 2d with a data() view, such as image_2d.
+  template<typename I>
+  concept image_operand = !image_expression<I> && requires(const I& image) {
+    typename I::value_type;
+    { image.data() };
+  } && std::remove_cvref_t<decltype(std::declval<const I&>().data())>::rank == 2;
+
+  template<typename X>
+  concept expression_operand = image_expression<X> || image_operand<X> || std::is_arithmetic_v<X>;
+
+  template<typename X>
+  auto as_expression(const X& x) {
+    if constexpr (image_expression<X>) {
+      return x;
+    } else if constexpr (image_operand<X>) {
+      return view_terminal<std::remove_cvref_t<decltype(x.data())>>{x.data()};
+    } else {
+      return scalar_terminal<X>{x};
+    }
+  }
+
+  template<typename X>
+  using expression_t = decltype(as_expression(std::declval<const X&>()));
+
+  template<typename Op, typename L, typename R>
+  auto make_binary_expression(const L& lhs, const R& rhs) {
+    return binary_expression<Op, expression_t<L>, expression_t<R>>{as_expression(lhs), as_expression(rhs)};
+  }
+
+  template<typename L, typename R>
+  concept expression_operands = expression_operand<L> && expression_operand<R> &&
+    !(std::is_arithmetic_v<L> && std::is_arithmetic_v<R>);
+
+  template<typename L, typename R>
+  requires expression_operands<L, R>
+  auto operator+(const L& lhs, const R& rhs) { return make_binary_expression<ops::plus>(lhs, rhs); }
+
+  template<typename L, typename R>
+  requires expression_operands<L, R>
+  auto operator-(const L& lhs, const R& rhs) { return make_binary_expression<ops::minus>(lhs, rhs); }
+
+  template<typename L, typename R>
+  requires expression_operands<L, R>
+  auto operator*(const L& lhs, const R& rhs) { return make_binary_expression<ops::multiplies>(lhs, rhs); }
+
+  template<typename L, typename R>
+  requires expression_operands<L, R>
+  auto operator/(const L& lhs, const R& rhs) { return make_binary_expression<ops::divides>(lhs, rhs); }
+
+  template<typename U, typename X>
+  requires (image_expression<X> || image_operand<X>)
+  auto cast(const X& x) {
+    return cast_expression<U, expression_t<X>>{as_expression(x)};
+  }
+
+  // Saturates an expression to [lo, hi]. Named so it can't collide with Kokkos::clamp or
+  // std::clamp through ADL.
+  template<typename X>
+  requires (image_expression<X> || image_operand<X>)
+  auto clamped(const X& x, typename expression_t<X>::value_type lo, typename expression_t<X>::value_type hi) {
+    return clamp_expression<expression_t<X>>{as_expression(x), lo, hi};
+  }
+}
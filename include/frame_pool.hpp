@@ -0,0 +1,131 @@
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace ko::image {
+  struct frame_pool_stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t images = 0;  // allocated by the pool, in use or not
+    size_t bytes = 0;
+  };
+
+  // Recycles image buffers so per-frame temporaries don't allocate in steady state.
+  // Buffers are kept in free lists by shape; acquire() hands out one that nothing
+  // outside the pool references any more, or allocates a new one on a miss. An image,
+  // and any roi() or copy of it, keeps its buffer out of the pool until the last handle
+  // goes away. Pooled images are not zero filled.
+  //
+  // Dropping the last handle doesn't mean the kernels queued on the buffer are done, so
+  // the pool also remembers the execution space instance each buffer was last used on:
+  // the one it was acquired for, or the one passed to release(). Handing the buffer to
+  // work on another instance fences that instance first; on the same instance the queue
+  // already orders the old work first.
+  template<typename T>
+  class frame_pool {
+    using shape = std::tuple<size_t, size_t, row_padding>;
+
+    struct pooled {
+      view<T**> buffer;
+      Kokkos::DefaultExecutionSpace last_used;
+    };
+
+    mutable std::mutex mutex_;
+    std::map<shape, std::vector<pooled>> free_lists_;
+    frame_pool_stats stats_;
+
+  public:
+    frame_pool() = default;
+    frame_pool(const frame_pool&) = delete;
+    frame_pool& operator=(const frame_pool&) = delete;
+
+    // An image for work queued on space.
+    image_2d<T> acquire(size_t width, size_t height, row_padding padding = row_padding::none, const Kokkos::DefaultExecutionSpace& space = {}) {
+      std::lock_guard lock(mutex_);
+      auto& buffers = free_lists_[{width, height, padding}];
+      for (auto& entry : buffers) {
+        if (entry.buffer.use_count() == 1) {
+          if (!(entry.last_used == space)) entry.last_used.fence();
+          entry.last_used = space;
+          stats_.hits += 1;
+          return image_2d<T>(entry.buffer);
+        }
+      }
+
+      auto buffer = padding == row_padding::aligned
+        ? view<T**>(Kokkos::view_alloc(Kokkos::WithoutInitializing, "frame_pool", Kokkos::AllowPadding), width, height)
+        : view<T**>(Kokkos::view_alloc(Kokkos::WithoutInitializing, "frame_pool"), width, height);
+      buffers.push_back({buffer, space});
+      stats_.misses += 1;
+      stats_.images += 1;
+      stats_.bytes += buffer.span() * sizeof(T);
+      return image_2d<T>(buffer);
+    }
+
+    // Records that image's buffer was last used by work queued on space, when that isn't
+    // the instance it was acquired for. Call it once nothing else will be queued on the
+    // image; the buffer goes back to the pool when its last handle is dropped.
+    void release(const image_2d<T>& image, const Kokkos::DefaultExecutionSpace& space) {
+      std::lock_guard lock(mutex_);
+      const auto data = image.frame().data();
+      for (auto& [key, buffers] : free_lists_) {
+        for (auto& entry : buffers) {
+          if (entry.buffer.data() == data) {
+            entry.last_used = space;
+            return;
+          }
+        }
+      }
+    }
+
+    // A pooled image holding expr, evaluated in one kernel.
+    template<image_expression E>
+    image_2d<T> acquire(const E& expr) {
+      auto image = acquire(expr.width(), expr.height());
+      image.assign(expr);
+      return image;
+    }
+
+    // Frees the buffers nothing is using.
+    void trim() {
+      std::lock_guard lock(mutex_);
+      for (auto& [key, buffers] : free_lists_) {
+        std::erase_if(buffers, [&](const pooled& entry) {
+          if (entry.buffer.use_count() != 1) return false;
+          entry.last_used.fence();
+          stats_.images -= 1;
+          stats_.bytes -= entry.buffer.span() * sizeof(T);
+          return true;
+        });
+      }
+    }
+
+    // Drops every buffer, in use or not. Images still held outside the pool stay valid.
+    void clear() {
+      std::lock_guard lock(mutex_);
+      free_lists_.clear();
+      stats_.images = 0;
+      stats_.bytes = 0;
+    }
+
+    frame_pool_stats stats() const {
+      std::lock_guard lock(mutex_);
+      return stats_;
+    }
+  };
+
+  // Process wide pool for an element type, emptied when Kokkos is finalized so no view
+  // outlives it.
+  template<typename T>
+  frame_pool<T>& default_frame_pool() {
+    static frame_pool<T> pool;
+    static const bool hooked = (Kokkos::push_finalize_hook([] { pool.clear(); }), true);
+    (void)hooked;
+    return pool;
+  }
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <image.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace ko::pipeline {
+  // Bounded multi-producer multi-consumer queue of slot indices (Dmitry Vyukov's design).
+  // Each cell's sequence number says whether it is ready to be written or read for the
+  // current lap, so push and pop are one CAS on their own counter and never take a lock.
+  class index_queue {
+    struct cell {
+      std::atomic<size_t> sequence;
+      uint32_t value;
+    };
+
+    std::unique_ptr<cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> enqueue_position_{0};
+    alignas(64) std::atomic<size_t> dequeue_position_{0};
+
+  public:
+    // capacity is rounded up to a power of two.
+    explicit index_queue(size_t capacity) {
+      size_t size = 2;
+      while (size < capacity) size *= 2;
+      cells_ = std::make_unique<cell[]>(size);
+      mask_ = size - 1;
+      for (size_t i = 0; i < size; ++i) cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(uint32_t value) {
+      size_t position = enqueue_position_.load(std::memory_order_relaxed);
+      for (;;) {
+        cell& c = cells_[position & mask_];
+        const size_t sequence = c.sequence.load(std::memory_order_acquire);
+        const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+        if (difference == 0) {
+          if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            c.value = value;
+            c.sequence.store(position + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (difference < 0) {
+          return false;
+        } else {
+          position = enqueue_position_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    bool try_pop(uint32_t& value) {
+      size_t position = dequeue_position_.load(std::memory_order_relaxed);
+      for (;;) {
+        cell& c = cells_[position & mask_];
+        const size_t sequence = c.sequence.load(std::memory_order_acquire);
+        const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1);
+        if (difference == 0) {
+          if (dequeue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            value = c.value;
+            c.sequence.store(position + mask_ + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (difference < 0) {
+          return false;
+        } else {
+          position = dequeue_position_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+  };
+
+  enum class overflow_policy {
+    block,       // producers wait for a consumer to release a slot
+    drop_oldest  // producers reclaim the oldest frame nobody has picked up yet
+  };
+
+  // A frame slot on loan from a frame_ring. frame is free for the producer to number the
+  // frame with; it travels with the slot to the consumer.
+  template<typename T>
+  struct frame_slot {
+    uint32_t index;
+    uint64_t frame;
+    ko::image::image_2d<T> image;
+  };
+
+  struct frame_ring_stats {
+    uint64_t published;
+    uint64_t consumed;
+    uint64_t dropped;
+  };
+
+  // Hands preallocated frames between pipeline stages without locks. Producers acquire a
+  // free slot, fill it and publish it; consumers take published slots in order and
+  // release them back. Slots move between a free queue and a ready queue, so a slot is
+  // owned by exactly one thread at a time and the queues' release/acquire ordering makes
+  // the owner's host writes visible to the next. Device work on a slot's image must be
+  // fenced before publish or release.
+  //
+  // Waiting spins and then yields, which suits stage threads that own a core.
+  template<typename T>
+  class frame_ring {
+    std::vector<ko::image::image_2d<T>> images_;
+    std::vector<uint64_t> frames_;
+    index_queue free_;
+    index_queue ready_;
+    overflow_policy policy_;
+    std::atomic<bool> closed_{false};
+    std::atomic<uint64_t> published_{0};
+    std::atomic<uint64_t> consumed_{0};
+    std::atomic<uint64_t> dropped_{0};
+
+    static void backoff(int& attempt) {
+      if (++attempt < 64) return;
+      std::this_thread::yield();
+    }
+
+    frame_slot<T> slot(uint32_t index) const { return {index, frames_[index], images_[index]}; }
+
+  public:
+    frame_ring(size_t width, size_t height, size_t slots, overflow_policy policy = overflow_policy::block)
+      : frames_(slots), free_(slots), ready_(slots), policy_(policy) {
+      images_.reserve(slots);
+      for (size_t i = 0; i < slots; ++i) {
+        images_.emplace_back(width, height);
+        free_.try_push(static_cast<uint32_t>(i));
+      }
+    }
+
+    frame_ring(const frame_ring&) = delete;
+    frame_ring& operator=(const frame_ring&) = delete;
+
+    size_t size() const { return images_.size(); }
+    overflow_policy policy() const { return policy_; }
+
+    // A free slot, or under drop_oldest the oldest published one, or nothing.
+    std::optional<frame_slot<T>> try_acquire() {
+      uint32_t index;
+      if (free_.try_pop(index)) return slot(index);
+      if (policy_ == overflow_policy::drop_oldest && ready_.try_pop(index)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return slot(index);
+      }
+      return std::nullopt;
+    }
+
+    frame_slot<T> acquire() {
+      for (int attempt = 0;; backoff(attempt)) {
+        if (auto acquired = try_acquire()) return *acquired;
+      }
+    }
+
+    void publish(const frame_slot<T>& frame) {
+      frames_[frame.index] = frame.frame;
+      published_.fetch_add(1, std::memory_order_relaxed);
+      // Never full: there are as many cells as slots.
+      ready_.try_push(frame.index);
+    }
+
+    std::optional<frame_slot<T>> try_consume() {
+      uint32_t index;
+      if (!ready_.try_pop(index)) return std::nullopt;
+      consumed_.fetch_add(1, std::memory_order_relaxed);
+      return slot(index);
+    }
+
+    // The next published frame, or nothing once the ring is closed and drained.
+    std::optional<frame_slot<T>> consume() {
+      for (int attempt = 0;; backoff(attempt)) {
+        if (auto frame = try_consume()) return frame;
+        if (closed_.load(std::memory_order_acquire)) return try_consume();
+      }
+    }
+
+    void release(const frame_slot<T>& frame) {
+      free_.try_push(frame.index);
+    }
+
+    // Producers are done; consumers drain what is published and then get nothing.
+    void close() { closed_.store(true, std::memory_order_release); }
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+    frame_ring_stats stats() const {
+      return {published_.load(std::memory_order_relaxed), consumed_.load(std::memory_order_relaxed), dropped_.load(std::memory_order_relaxed)};
+    }
+  };
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <image.hpp>
+#include <io.hpp>
+#include <thread_pool.hpp>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ko::io {
+  // Where the frames of an acquisition come from: the pages of a multi-page TIFF, or one
+  // file per frame. A multi-page TIFF the native codec handles is opened once and its
+  // pages decoded straight from the page table; OpenCV reads the rest.
+  class page_source {
+    std::string multi_page_path_;
+    std::vector<std::string> paths_;
+    std::shared_ptr<const tiff_reader> tiff_;
+    size_t count_ = 0;
+
+    cv::Mat decode_tiff(size_t index) const {
+      const auto page = tiff_->page(index);
+      if (page.bits == 8) {
+        cv::Mat mat(page.height, page.width, cv::DataType<uint8_t>::type);
+        tiff_->read(page, mat.ptr<uint8_t>(), mat.step1());
+        return mat;
+      }
+      cv::Mat mat(page.height, page.width, cv::DataType<uint16_t>::type);
+      tiff_->read(page, mat.ptr<uint16_t>(), mat.step1());
+      return mat;
+    }
+
+  public:
+    static page_source multi_page(const std::string& path) {
+      page_source source;
+      source.multi_page_path_ = path;
+      if (is_tiff_path(path)) {
+        try {
+          source.tiff_ = std::make_shared<const tiff_reader>(path);
+          source.count_ = source.tiff_->page_count();
+        } catch (const tiff_unsupported&) {
+          // Fall through to OpenCV.
+        }
+      }
+      if (!source.tiff_) source.count_ = cv::imcount(path, cv::IMREAD_UNCHANGED);
+      if (source.count_ == 0) throw std::runtime_error("Failed to read image: " + path);
+      return source;
+    }
+
+    static page_source files(std::vector<std::string> paths) {
+      page_source source;
+      source.count_ = paths.size();
+      source.paths_ = std::move(paths);
+      return source;
+    }
+
+    // count files named by a printf pattern with one integer conversion, starting at first,
+    // e.g. "dark_%04d.tif".
+    static page_source numbered(const std::string& pattern, int first, size_t count) {
+      std::vector<std::string> paths;
+      paths.reserve(count);
+      std::vector<char> buffer(pattern.size() + 32);
+      for (size_t i = 0; i < count; ++i) {
+        std::snprintf(buffer.data(), buffer.size(), pattern.c_str(), first + static_cast<int>(i));
+        paths.emplace_back(buffer.data());
+      }
+      return files(std::move(paths));
+    }
+
+    size_t size() const { return count_; }
+
+    // Safe to call concurrently for different frames.
+    cv::Mat decode(size_t index) const {
+      cv::Mat mat;
+      if (tiff_) {
+        try {
+          return decode_tiff(index);
+        } catch (const tiff_unsupported&) {
+          // A page the native codec doesn't handle, e.g. compressed with LZW.
+        }
+      }
+      if (paths_.empty()) {
+        std::vector<cv::Mat> pages;
+        if (cv::imreadmulti(multi_page_path_, pages, static_cast<int>(index), 1, cv::IMREAD_UNCHANGED) && !pages.empty()) {
+          mat = pages.front();
+        }
+      } else {
+        mat = cv::imread(paths_[index], cv::IMREAD_UNCHANGED);
+      }
+      if (mat.empty()) {
+        throw std::runtime_error("Failed to read frame " + std::to_string(index) + " of " +
+          (paths_.empty() ? multi_page_path_ : paths_[index]));
+      }
+      return mat;
+    }
+  };
+
+  // Decodes the frames of a page_source on a thread pool, keeping up to capacity frames in
+  // flight ahead of the consumer, and hands them over in order. Frames can be processed as
+  // soon as they arrive while later ones are still decoding.
+  template<typename T>
+  class frame_stream {
+    page_source source_;
+    ko::concurrency::thread_pool& pool_;
+    std::deque<std::future<cv::Mat>> pending_;
+    size_t submitted_ = 0;
+    size_t delivered_ = 0;
+    size_t capacity_;
+
+    void top_up() {
+      while (submitted_ < source_.size() && pending_.size() < capacity_) {
+        const size_t index = submitted_++;
+        pending_.push_back(pool_.submit([this, index] { return source_.decode(index); }));
+      }
+    }
+
+  public:
+    frame_stream(page_source source, ko::concurrency::thread_pool& pool, size_t capacity = 0)
+      : source_(std::move(source)), pool_(pool), capacity_(capacity ? capacity : 2 * pool.size()) {
+      top_up();
+    }
+
+    frame_stream(const frame_stream&) = delete;
+    frame_stream& operator=(const frame_stream&) = delete;
+
+    // Outstanding decodes reference this stream.
+    ~frame_stream() {
+      for (auto& pending : pending_) pending.wait();
+    }
+
+    size_t size() const { return source_.size(); }
+    size_t delivered() const { return delivered_; }
+
+    // The next decoded frame, in order, or an empty Mat when the source is exhausted.
+    cv::Mat next_mat() {
+      if (pending_.empty()) return cv::Mat();
+      auto future = std::move(pending_.front());
+      pending_.pop_front();
+      top_up();
+      cv::Mat mat = future.get();
+      if (mat.type() != cv::DataType<T>::type) throw std::runtime_error("Frame type doesn't match image element type");
+      delivered_ += 1;
+      return mat.isContinuous() ? mat : mat.clone();
+    }
+
+    // Copies the next frame into dst. Returns false once the source is exhausted.
+    bool next(ko::image::image_2d<T> dst) {
+      cv::Mat mat = next_mat();
+      if (mat.empty()) return false;
+      if (static_cast<size_t>(mat.cols) != dst.width() || static_cast<size_t>(mat.rows) != dst.height()) {
+        throw std::runtime_error("Frame size doesn't match destination image");
+      }
+      copy_from_host(dst, host_view_of<T>(mat));
+      return true;
+    }
+  };
+
+  // Decodes every frame of source in parallel into one image_3d, frame k at depth k.
+  template<typename T>
+  ko::image::image_3d<T> read_stack(page_source source, ko::concurrency::thread_pool& pool) {
+    const size_t depth = source.size();
+    frame_stream<T> stream(std::move(source), pool);
+
+    cv::Mat mat = stream.next_mat();
+    ko::image::image_3d<T> stack(mat.cols, mat.rows, depth);
+    for (size_t k = 0; !mat.empty(); ++k, mat = stream.next_mat()) {
+      if (static_cast<size_t>(mat.cols) != stack.width() || static_cast<size_t>(mat.rows) != stack.height()) {
+        throw std::runtime_error("Frame size differs within stack");
+      }
+      Kokkos::deep_copy(Kokkos::subview(stack.data(), Kokkos::ALL(), Kokkos::ALL(), k), host_view_of<T>(mat));
+    }
+    return stack;
+  }
+}
@@ -1,162 +1,244 @@
-#pragma once
-
-#include <kokkos_types.hpp>
-#include <optional>
-
-namespace ko::image {
-  template<typename F, typename T>
-  concept parallel_for_width_height = requires(F f, const size_t x, const size_t y, view<T**> data, const size_t width, const size_t height) {
-    { f(x, y, data, width, height) } -> std::same_as<void>;
-  };
-
-  template<typename F, typename T>
-  concept parallel_for_std = requires(F f, const size_t x, const size_t y, view<T**> data) {
-    { f(x, y, data) } -> std::same_as<void>;
-  };
-
-  template<typename T>
-  class image_2d {
-    view<T**> data_;
-  public:
-    image_2d(size_t width, size_t height)
-      : data_("image_2d", width, height) {}
-
-    image_2d(view<T**> data)
-      : data_(data) {}
-
-    size_t width() const { return data_.extent(0); }
-    size_t height() const { return data_.extent(1); }
-    view<T**> data() const { return data_; }
-    size_t element_count() const { return width() * height(); }
-
-    template<typename F>
-    void parallel_for(F f) const {
-      Kokkos::MDRangePolicy<Kokkos::Rank<2>> policy({0, 0}, {data_.extent(0), data_.extent(1)});
-      Kokkos::parallel_for("image_2d parallel_for", policy, f);
-    }
-
-    template<typename F>
-    requires parallel_for_std<F, T>
-    void parallel_for(F func) {
-      auto data = data_;
-      Kokkos::MDRangePolicy<Kokkos::Rank<2>> policy({0, 0}, {width(), height()});
-      Kokkos::parallel_for("image_2d parallel_for", policy, KOKKOS_LAMBDA(const size_t x, const size_t y) {
-        func(x, y, data);
-      });
-    }
-
-    template<typename F>
-    requires parallel_for_width_height<F, T>  
-    void parallel_for(F func) {
-      auto data = data_;
-      auto w = width();
-      auto h = height();
-      Kokkos::MDRangePolicy<Kokkos::Rank<2>> policy({0, 0}, {w, h});
-      Kokkos::parallel_for("image_2d parallel_for", policy, KOKKOS_LAMBDA(const size_t x, const size_t y) {
-        func(x, y, data, w, h);
-      });
-    }
-
-    template<typename F, typename R>
-    void parallel_reduce(F f, R r) const {
-        Kokkos::MDRangePolicy<Kokkos::Rank<2>> policy({0, 0}, {width(), height()});
-        Kokkos::parallel_reduce("image_2d parallel reduce", policy, f, r);
-    }
-
-    image_2d operator+(const image_2d other) const {
-      assert(width() == other.width() && height() == other.height());
-      image_2d result(width(), height());
-      auto data = data_;
-      auto other_data = other.data();
-      parallel_for(KOKKOS_LAMBDA(int i, int j) {
-        data(i, j) = data(i, j) + other_data(i, j);
-      });
-      return result;
-    }
-
-    image_2d operator+(T scalar) const {
-      image_2d result(width(), height());
-      auto data = data_;
-      auto res_data = result.data();
-      parallel_for(KOKKOS_LAMBDA(int i, int j) {
-        res_data(i, j) = data(i, j) + scalar;
-      });
-      return result;
-    }
-
-    image_2d& operator+=(const image_2d& other) {
-      assert(width() == other.width() && height() == other.height());
-      auto data = data_;
-      auto other_data = other.data();
-      parallel_for(KOKKOS_LAMBDA(int x, int y) {
-        data(x, y) = data(x, y) + other_data(x, y);
-      });
-      return *this;
-    }
-
-    image_2d& operator+=(T scalar) {
-      auto data = data_;
-      parallel_for(KOKKOS_LAMBDA(int i, int j) {
-        data(i, j) = data(i, j) + scalar;
-      });
-      return *this;
-    }
-
-    image_2d operator-(const image_2d other) const {
-      assert(width() == other.width() && height() == other.height());
-      image_2d result(width(), height());
-      auto data = data_;
-      auto other_data = other.data();
-      auto res_data = result.data();
-      parallel_for(KOKKOS_LAMBDA(int i, int j) {
-        res_data(i, j) = data(i, j) - other_data(i, j);
-      });
-      return result;
-    }
-
-    image_2d operator-(T scalar) const {
-      image_2d result(width(), height());
-      auto data = data_;
-      auto res_data = result.data();
-      parallel_for(KOKKOS_LAMBDA(int i, int j) {
-        res_data(i, j) = data(i, j) - scalar;
-      });
-      return result;
-    }
-
-    image_2d& operator-=(const image_2d& other) {
-      assert(width() == other.width() && height() == other.height());
-      auto data = data_;
-      auto other_data = other.data();
-      parallel_for(KOKKOS_LAMBDA(int i, int j) {
-        data(i, j) = data(i, j) - other_data(i, j);
-      });
-      return *this;
-    }
-
-    image_2d& operator-=(T scalar) {
-      auto data = data_;
-      parallel_for(KOKKOS_LAMBDA(int i, int j) {
-        data(i, j) = data(i, j) - scalar;
-      });
-      return *this;
-    }
-  };
-
-  template<typename T>
-  class image_3d {
-    view<T***> data_;
-
-  public:
-    using value_type = T;
-    image_3d(size_t width, size_t height, size_t depth)
-      : data_("image_3d", width, height, depth) {}
-
-    size_t width() const { return data_.extent(0); }
-    size_t height() const { return data_.extent(1); }
-    size_t depth() const { return data_.extend(2); }
-    view<T***> data() const { return data_; }
-    size_t element_count() const { return data_.size(); }
-  };
-
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <expressions.hpp>
+#include <memory>
+#include <optional>
+
+namespace ko::image {
+  template<typename F, typename T>
+  concept parallel_for_width_height = requires(F f, const size_t x, const size_t y, view<T**> data, const size_t width, const size_t height) {
+    { f(x, y, data, width, height) } -> std::same_as<void>;
+  };
+
+  template<typename F, typename T>
+  concept parallel_for_std = requires(F f, const size_t x, const size_t y, view<T**> data) {
+    { f(x, y, data) } -> std::same_as<void>;
+  };
+
+  // How pixels outside an image are sampled by neighbourhood operations.
+  enum class border_mode {
+    replicate,  // nearest edge pixel
+    reflect,    // mirrored about the edge pixel, dcb|abcd|cba
+    constant,   // zero
+    valid       // excluded, averages are taken over in-bounds pixels only
+  };
+
+  // Index that position i along an axis of length n samples under mode, or -1 if the
+  // sample is zero / excluded.
+  KOKKOS_INLINE_FUNCTION
+  int border_index(int i, int n, border_mode mode) {
+    if (i >= 0 && i < n) return i;
+    switch (mode) {
+      case border_mode::replicate:
+        return i < 0 ? 0 : n - 1;
+      case border_mode::reflect: {
+        if (n == 1) return 0;
+        const int period = 2 * (n - 1);
+        i = Kokkos::abs(i) % period;
+        return i < n ? i : period - i;
+      }
+      default:
+        return -1;
+    }
+  }
+
+  // Whether rows are padded so each starts on a cache line, see image_2d::pitch(). Padded
+  // images copy to and from unpadded views with a kernel rather than a memcpy, so only
+  // pad images whose host side is padded the same way or device accessible.
+  enum class row_padding {
+    none,
+    aligned
+  };
+
+  // An image_2d is either a whole frame or a region of interest cut from one with roi().
+  // A region shares the frame's storage and keeps the frame and its offset in it, so
+  // neighbourhood operations on the region read their halo from the real pixels around
+  // it and only apply the border at the frame's edges.
+  //
+  // An image over memory Kokkos didn't allocate, such as a decoded cv::Mat, can carry an
+  // owner that keeps that memory alive for as long as any copy or region of the image.
+  template<typename T>
+  class image_2d {
+    view<T**> data_;
+    view<T**> frame_;
+    size_t x_ = 0;
+    size_t y_ = 0;
+    std::shared_ptr<const void> owner_;
+
+    image_2d(view<T**> data, view<T**> frame, size_t x, size_t y, std::shared_ptr<const void> owner)
+      : data_(data), frame_(frame), x_(x), y_(y), owner_(std::move(owner)) {}
+
+  public:
+    using value_type = T;
+
+    image_2d(size_t width, size_t height, row_padding padding = row_padding::none)
+      : data_(padding == row_padding::aligned
+          ? view<T**>(Kokkos::view_alloc("image_2d", Kokkos::AllowPadding), width, height)
+          : view<T**>("image_2d", width, height)),
+        frame_(data_) {}
+
+    image_2d(view<T**> data)
+      : data_(data), frame_(data) {}
+
+    // Image over unmanaged data whose storage owner keeps alive.
+    image_2d(view<T**> data, std::shared_ptr<const void> owner)
+      : data_(data), frame_(data), owner_(std::move(owner)) {}
+
+    // Allocates an image and evaluates expr into it.
+    template<image_expression E>
+    image_2d(const E& expr)
+      : data_("image_2d", expr.width(), expr.height()), frame_(data_) {
+      assign(expr);
+    }
+
+    // Evaluates expr into this image's existing storage in one kernel.
+    template<image_expression E>
+    image_2d& operator=(const E& expr) {
+      assign(expr);
+      return *this;
+    }
+
+    template<image_expression E>
+    void assign(const E& expr) {
+      assert(width() == expr.width() && height() == expr.height());
+      auto data = data_;
+      parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y) {
+        data(x, y) = static_cast<T>(expr(x, y));
+      });
+    }
+
+    size_t width() const { return data_.extent(0); }
+    size_t height() const { return data_.extent(1); }
+    // Elements from the start of one row to the start of the next.
+    size_t pitch() const { return data_.stride(1); }
+    view<T**> data() const { return data_; }
+    size_t element_count() const { return width() * height(); }
+
+    // The width x height region at (x, y), sharing this image's storage.
+    image_2d roi(size_t x, size_t y, size_t width, size_t height) const {
+      assert(x + width <= this->width() && y + height <= this->height());
+      auto data = Kokkos::subview(data_, Kokkos::make_pair(x, x + width), Kokkos::make_pair(y, y + height));
+      return image_2d(data, frame_, x_ + x, y_ + y, owner_);
+    }
+
+    // This region grown by up to radius pixels on each side, as far as the frame goes.
+    image_2d with_halo(size_t radius) const {
+      const size_t x = x_ - Kokkos::min(x_, radius);
+      const size_t y = y_ - Kokkos::min(y_, radius);
+      const size_t right = Kokkos::min(frame_.extent(0), x_ + width() + radius);
+      const size_t bottom = Kokkos::min(frame_.extent(1), y_ + height() + radius);
+      auto data = Kokkos::subview(frame_, Kokkos::make_pair(x, right), Kokkos::make_pair(y, bottom));
+      return image_2d(data, frame_, x, y, owner_);
+    }
+
+    // The whole frame a region was cut from, and the region's offset in it.
+    view<T**> frame() const { return frame_; }
+    size_t x_offset() const { return x_; }
+    size_t y_offset() const { return y_; }
+
+    template<typename F>
+    void parallel_for(F f) const {
+      image_policy policy({0, 0}, {data_.extent(0), data_.extent(1)});
+      Kokkos::parallel_for("image_2d parallel_for", policy, f);
+    }
+
+    template<typename F>
+    requires parallel_for_std<F, T>
+    void parallel_for(F func) {
+      auto data = data_;
+      image_policy policy({0, 0}, {width(), height()});
+      Kokkos::parallel_for("image_2d parallel_for", policy, KOKKOS_LAMBDA(const size_t x, const size_t y) {
+        func(x, y, data);
+      });
+    }
+
+    template<typename F>
+    requires parallel_for_width_height<F, T>  
+    void parallel_for(F func) {
+      auto data = data_;
+      auto w = width();
+      auto h = height();
+      image_policy policy({0, 0}, {w, h});
+      Kokkos::parallel_for("image_2d parallel_for", policy, KOKKOS_LAMBDA(const size_t x, const size_t y) {
+        func(x, y, data, w, h);
+      });
+    }
+
+    template<typename F, typename R>
+    void parallel_reduce(F f, R r) const {
+        image_policy policy({0, 0}, {width(), height()});
+        Kokkos::parallel_reduce("image_2d parallel reduce", policy, f, r);
+    }
+
+    image_2d& operator+=(const image_2d& other) {
+      assert(width() == other.width() && height() == other.height());
+      auto data = data_;
+      auto other_data = other.data();
+      parallel_for(KOKKOS_LAMBDA(int x, int y) {
+        data(x, y) = data(x, y) + other_data(x, y);
+      });
+      return *this;
+    }
+
+    image_2d& operator+=(T scalar) {
+      auto data = data_;
+      parallel_for(KOKKOS_LAMBDA(int i, int j) {
+        data(i, j) = data(i, j) + scalar;
+      });
+      return *this;
+    }
+
+    image_2d& operator-=(const image_2d& other) {
+      assert(width() == other.width() && height() == other.height());
+      auto data = data_;
+      auto other_data = other.data();
+      parallel_for(KOKKOS_LAMBDA(int i, int j) {
+        data(i, j) = data(i, j) - other_data(i, j);
+      });
+      return *this;
+    }
+
+    image_2d& operator-=(T scalar) {
+      auto data = data_;
+      parallel_for(KOKKOS_LAMBDA(int i, int j) {
+        data(i, j) = data(i, j) - scalar;
+      });
+      return *this;
+    }
+  };
+
+  // A stack of equally sized frames, frame k at depth k, each stored like an image_2d.
+  // Point-wise corrections and statistics have stack overloads that process every frame
+  // in one launch.
+  template<typename T>
+  class image_3d {
+    view<T***> data_;
+
+  public:
+    using value_type = T;
+    image_3d(size_t width, size_t height, size_t depth)
+      : data_("image_3d", width, height, depth) {}
+
+    image_3d(view<T***> data)
+      : data_(data) {}
+
+    size_t width() const { return data_.extent(0); }
+    size_t height() const { return data_.extent(1); }
+    size_t depth() const { return data_.extent(2); }
+    view<T***> data() const { return data_; }
+    size_t element_count() const { return data_.size(); }
+
+    // Frame k, sharing the stack's storage.
+    image_2d<T> frame(size_t k) const {
+      return image_2d<T>(Kokkos::subview(data_, Kokkos::ALL, Kokkos::ALL, k));
+    }
+
+    template<typename F>
+    void parallel_for(F f) const {
+      stack_policy policy({0, 0, 0}, {width(), height(), depth()});
+      Kokkos::parallel_for("image_3d parallel_for", policy, f);
+    }
+  };
+
 }
\ No newline at end of file
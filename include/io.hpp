@@ -1,25 +1,216 @@
-#pragma once
-
-#include <image.hpp>
-
-namespace ko::io {
-  ko::image::image_2d<uint16_t> read_image(std::string path) {
-    cv::Mat mat = cv::imread(path, cv::IMREAD_UNCHANGED);
-    view<uint16_t**> data("Test", mat.cols, mat.rows);
-    auto host_mirror = Kokkos::create_mirror_view(data);
-    std::memcpy(host_mirror.data(), mat.data, data.size() * sizeof(uint16_t));
-    Kokkos::deep_copy(data, host_mirror);
-    ko::image::image_2d<uint16_t> image(data);
-    return image;
-  }
-
-  void save_image(ko::image::image_2d<uint16_t> img, std::string filepath) {
-    cv::Mat cv_img(img.height(), img.width(), CV_16UC1);
-    auto host_mirror = Kokkos::create_mirror_view(img.data());
-    Kokkos::deep_copy(host_mirror, img.data());
-    std::memcpy(cv_img.data, host_mirror.data(), img.element_count() * sizeof(uint16_t));
-    if (!cv::imwrite(filepath, cv_img)) {
-      throw std::runtime_error("Failed to save image: " + filepath);
-    }
-  }
-}
\ No newline at end of file
+#pragma once
+
+#include <image.hpp>
+#include <frame_pool.hpp>
+#include <thread_pool.hpp>
+#include <tiff.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace ko::io {
+  // Host view laid out like a continuous single channel cv::Mat, x contiguous.
+  template<typename T>
+  using host_view = Kokkos::View<T**, image_layout, Kokkos::HostSpace>;
+
+  // True when image_2d<T> storage is host memory, so an image and a Mat can share one
+  // buffer. Image rows are laid out like a Mat's on every backend.
+  template<typename T>
+  constexpr bool mat_compatible =
+    Kokkos::SpaceAccessibility<Kokkos::HostSpace, typename view<T**>::memory_space>::accessible;
+
+  template<typename T>
+  host_view<T> host_view_of(const cv::Mat& mat) {
+    return host_view<T>(reinterpret_cast<T*>(mat.data), mat.cols, mat.rows);
+  }
+
+  // Copies between an image and a contiguous host buffer of its size. A region or padded
+  // image isn't contiguous, and a copy between memory spaces can only move contiguous
+  // spans, so on a device backend those are packed into a pooled device buffer first.
+  template<typename T>
+  void copy_to_host(host_view<T> host, const ko::image::image_2d<T> image) {
+    auto data = image.data();
+    if (mat_compatible<T> || data.span_is_contiguous()) {
+      Kokkos::deep_copy(host, data);
+    } else {
+      auto packed = ko::image::default_frame_pool<T>().acquire(image.width(), image.height());
+      Kokkos::deep_copy(packed.data(), data);
+      Kokkos::deep_copy(host, packed.data());
+    }
+  }
+
+  template<typename T>
+  void copy_from_host(ko::image::image_2d<T> image, host_view<T> host) {
+    auto data = image.data();
+    if (mat_compatible<T> || data.span_is_contiguous()) {
+      Kokkos::deep_copy(data, host);
+    } else {
+      auto packed = ko::image::default_frame_pool<T>().acquire(image.width(), image.height());
+      Kokkos::deep_copy(packed.data(), host);
+      Kokkos::deep_copy(data, packed.data());
+    }
+  }
+
+  // cv::Mat header over an image's host buffer, no copy. The Mat doesn't own the pixels,
+  // the image has to outlive it.
+  template<typename T>
+  cv::Mat as_mat(const ko::image::image_2d<T> image) {
+    static_assert(mat_compatible<T>, "image_2d storage isn't host memory on this backend");
+    auto data = image.data();
+    return cv::Mat(image.height(), image.width(), cv::DataType<T>::type, data.data(), data.stride(1) * sizeof(T));
+  }
+
+  // A cv::Mat together with an image_2d of its pixels. With mat_compatible<T> the image is
+  // a view of the Mat's buffer that holds a reference to the Mat, so the pixels stay
+  // valid as long as either does; without, the image has its own storage and
+  // to_image() / to_mat() copy across.
+  template<typename T>
+  class mat_image {
+    cv::Mat mat_;
+    ko::image::image_2d<T> image_;
+
+    static cv::Mat checked(cv::Mat mat) {
+      if (mat.empty()) throw std::runtime_error("Empty cv::Mat");
+      if (mat.type() != cv::DataType<T>::type) throw std::runtime_error("cv::Mat type doesn't match image element type");
+      return mat.isContinuous() ? mat : mat.clone();
+    }
+
+    static ko::image::image_2d<T> image_for(const cv::Mat& mat) {
+      if constexpr (mat_compatible<T>) {
+        return ko::image::image_2d<T>(view<T**>(reinterpret_cast<T*>(mat.data), mat.cols, mat.rows), std::make_shared<const cv::Mat>(mat));
+      } else {
+        return ko::image::image_2d<T>(mat.cols, mat.rows);
+      }
+    }
+
+  public:
+    explicit mat_image(cv::Mat mat)
+      : mat_(checked(mat)), image_(image_for(mat_)) {
+      to_image();
+    }
+
+    mat_image(size_t width, size_t height)
+      : mat_(height, width, cv::DataType<T>::type), image_(image_for(mat_)) {}
+
+    const cv::Mat& mat() const { return mat_; }
+    ko::image::image_2d<T> image() const { return image_; }
+    host_view<T> host() const { return host_view_of<T>(mat_); }
+    static constexpr bool zero_copy() { return mat_compatible<T>; }
+
+    void to_image() {
+      if constexpr (!mat_compatible<T>) Kokkos::deep_copy(image_.data(), host());
+    }
+
+    void to_mat() {
+      if constexpr (!mat_compatible<T>) Kokkos::deep_copy(host(), image_.data());
+    }
+
+    // to_mat() queued on space, complete on return.
+    void to_mat(const Kokkos::DefaultExecutionSpace& space) {
+      if constexpr (!mat_compatible<T>) {
+        Kokkos::deep_copy(space, host(), image_.data());
+        space.fence();
+      }
+    }
+  };
+
+  template<typename T = uint16_t>
+  mat_image<T> read_mat_image(std::string path) {
+    cv::Mat mat = cv::imread(path, cv::IMREAD_UNCHANGED);
+    if (mat.empty()) {
+      throw std::runtime_error("Failed to read image: " + path);
+    }
+    return mat_image<T>(mat);
+  }
+
+  // Pool shared by the file codecs.
+  inline ko::concurrency::thread_pool& io_pool() {
+    static ko::concurrency::thread_pool pool;
+    return pool;
+  }
+
+  inline bool is_tiff_path(const std::string& path) {
+    const auto dot = path.find_last_of('.');
+    if (dot == std::string::npos) return false;
+    std::string extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+    return extension == "tif" || extension == "tiff";
+  }
+
+  // Decodes a page of a TIFF straight into the image's buffer where that's host
+  // memory, otherwise into a host staging buffer that is then copied to the device.
+  template<typename T = uint16_t>
+  ko::image::image_2d<T> read_tiff(const std::string& path, size_t page = 0, ko::concurrency::thread_pool& pool = io_pool()) {
+    tiff_reader reader(path);
+    const auto layout = reader.page(page);
+    ko::image::image_2d<T> image(layout.width, layout.height);
+    if constexpr (mat_compatible<T>) {
+      auto data = image.data();
+      reader.read(layout, data.data(), data.stride(1), pool);
+    } else {
+      host_view<T> staging(Kokkos::view_alloc(Kokkos::WithoutInitializing, "read_tiff staging"), layout.width, layout.height);
+      reader.read(layout, staging.data(), staging.stride(1), pool);
+      Kokkos::deep_copy(image.data(), staging);
+    }
+    return image;
+  }
+
+  template<typename T>
+  void save_tiff(ko::image::image_2d<T> img, const std::string& path, tiff_write_options options = {}, ko::concurrency::thread_pool& pool = io_pool()) {
+    if constexpr (mat_compatible<T>) {
+      Kokkos::fence();
+      auto data = img.data();
+      write_tiff(path, data.data(), img.width(), img.height(), data.stride(1), pool, options);
+    } else {
+      host_view<T> staging(Kokkos::view_alloc(Kokkos::WithoutInitializing, "save_tiff staging"), img.width(), img.height());
+      copy_to_host(staging, img);
+      write_tiff(path, staging.data(), img.width(), img.height(), staging.stride(1), pool, options);
+    }
+  }
+
+  // Decodes path into an image. Where image storage is host memory the image is the
+  // decoded buffer itself and keeps it alive; otherwise it's the device copy mat_image
+  // made. Use read_mat_image to keep the Mat too.
+  inline ko::image::image_2d<uint16_t> read_image(std::string path) {
+    if (is_tiff_path(path)) {
+      try {
+        return read_tiff<uint16_t>(path);
+      } catch (const tiff_unsupported&) {
+        // Fall through to OpenCV for the layouts the native codec doesn't handle.
+      }
+    }
+    return read_mat_image<uint16_t>(path).image();
+  }
+
+  // Writes a host Mat, through the native codec when it's a greyscale 8 or 16-bit TIFF.
+  inline void write_mat(const std::string& path, const cv::Mat& mat, const std::vector<int>& params = {}) {
+    if (is_tiff_path(path) && mat.type() == cv::DataType<uint16_t>::type) {
+      write_tiff(path, mat.ptr<uint16_t>(), mat.cols, mat.rows, mat.step1(), io_pool());
+    } else if (is_tiff_path(path) && mat.type() == cv::DataType<uint8_t>::type) {
+      write_tiff(path, mat.ptr<uint8_t>(), mat.cols, mat.rows, mat.step1(), io_pool());
+    } else if (!cv::imwrite(path, mat, params)) {
+      throw std::runtime_error("Failed to save image: " + path);
+    }
+  }
+
+  // Half precision images are widened to float, which the image codecs take.
+  template<typename T>
+  void save_image(ko::image::image_2d<T> img, std::string filepath) {
+    if constexpr (ko::maths::is_half_precision_v<T>) {
+      save_image(ko::image::image_2d<float>(ko::image::cast<float>(img)), filepath);
+    } else if constexpr (mat_compatible<T>) {
+      Kokkos::fence();
+      write_mat(filepath, as_mat(img));
+    } else {
+      mat_image<T> staging(img.width(), img.height());
+      copy_to_host(staging.host(), img);
+      write_mat(filepath, staging.mat());
+    }
+  }
+}
@@ -1,16 +1,27 @@
-#pragma once
-
-#include <Kokkos_Core.hpp>
-
-template<typename T, typename L = void>
-struct view_alias {
-    using type = Kokkos::View<T, L>;
-};
-
-template<typename T>
-struct view_alias<T, void> {
-    using type = Kokkos::View<T>;
-};
-
-template<typename T, typename L = void>
-using view = typename view_alias<T, L>::type;
\ No newline at end of file
+#pragma once
+
+#include <Kokkos_Core.hpp>
+
+// Images are stored with x, the column, fastest and rows one after another, on every
+// backend. That is how cv::Mat and image files lay pixels out, and what image_policy
+// walks.
+using image_layout = Kokkos::LayoutLeft;
+
+template<typename T, typename L = void>
+struct view_alias {
+    using type = Kokkos::View<T, L>;
+};
+
+template<typename T>
+struct view_alias<T, void> {
+    using type = Kokkos::View<T, image_layout>;
+};
+
+template<typename T, typename L = void>
+using view = typename view_alias<T, L>::type;
+
+// (x, y) iteration with x innermost, matching image_layout.
+using image_policy = Kokkos::MDRangePolicy<Kokkos::Rank<2, Kokkos::Iterate::Left, Kokkos::Iterate::Left>>;
+
+// (x, y, frame) iteration over an image_3d stack, x innermost.
+using stack_policy = Kokkos::MDRangePolicy<Kokkos::Rank<3, Kokkos::Iterate::Left, Kokkos::Iterate::Left>>;
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ko::io {
+  // Copy-on-write mapping of a whole file: pages are shared with the page cache until
+  // written to.
+  class mapped_file {
+    std::byte* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+
+  public:
+    explicit mapped_file(const std::string& path) {
+#ifdef _WIN32
+      file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+      if (file_ == INVALID_HANDLE_VALUE) throw std::runtime_error("Failed to open: " + path);
+      LARGE_INTEGER size;
+      if (!GetFileSizeEx(file_, &size)) throw std::runtime_error("Failed to stat: " + path);
+      size_ = static_cast<size_t>(size.QuadPart);
+      mapping_ = CreateFileMappingA(file_, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+      if (!mapping_) throw std::runtime_error("Failed to map: " + path);
+      data_ = static_cast<std::byte*>(MapViewOfFile(mapping_, FILE_MAP_COPY, 0, 0, 0));
+      if (!data_) throw std::runtime_error("Failed to map: " + path);
+#else
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) throw std::runtime_error("Failed to open: " + path);
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("Failed to stat: " + path);
+      }
+      size_ = static_cast<size_t>(st.st_size);
+      void* mapped = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (mapped == MAP_FAILED) throw std::runtime_error("Failed to map: " + path);
+      data_ = static_cast<std::byte*>(mapped);
+      madvise(data_, size_, MADV_SEQUENTIAL);
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+#ifdef _WIN32
+      if (data_) UnmapViewOfFile(data_);
+      if (mapping_) CloseHandle(mapping_);
+      if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+      if (data_) munmap(data_, size_);
+#endif
+    }
+
+    std::byte* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // Hints that [offset, offset + length) will be read soon.
+    void prefetch(size_t offset, size_t length) const {
+#ifdef _WIN32
+      WIN32_MEMORY_RANGE_ENTRY range{data_ + offset, length};
+      PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+      const size_t page = sysconf(_SC_PAGESIZE);
+      const size_t begin = offset / page * page;
+      madvise(data_ + begin, length + offset - begin, MADV_WILLNEED);
+#endif
+    }
+  };
+}
@@ -1,49 +1,83 @@
-#include <kokkos_types.hpp>
-#include <image.hpp>
-
-namespace ko::maths {
-  template<typename R, typename A, typename B>
-  ko::image::image_2d<R> subtract(ko::image::image_2d<A> image1, ko::image::image_2d<B> image2) {
-    ko::image::image_2d<R> result(image1.width(), image2.width());
-    auto result_data = result.data();
-    auto image1_data = image1.data();
-    auto image2_data = image2.data();
-    result.parallel_for(KOKKOS_LAMBDA(const int x, const int y) {
-      result_data(x, y) = static_cast<R>(image1_data(x, y)) - static_cast<R>(image2_data(x, y));
-    });
-  }
-
-  template<typename T>
-  void abs_diff(ko::image::image_2d<T> image1, ko::image::image_2d<T> image2, ko::image::image_2d<T> result) {
-    auto image1_data = image1.data();
-    auto image2_data = image2.data();
-    result.parallel_for(KOKKOS_LAMBDA(const int x, const int y, view<T**> data) {
-      data(x, y) = static_cast<T>(Kokkos::abs(image1_data(x, y) - image2_data(x, y)));
-    });
-  }
-
-  template<typename T>
-  ko::image::image_2d<T> abs_diff(ko::image::image_2d<T> image1, ko::image::image_2d<T> image2) {
-    ko::image::image_2d<T> result(image1.width(), image2.width());
-    abs_diff(image1, image2, result);
-    return result;
-  }
-
-  // // TODO: Handle overflow (saturating?)
-  // template<typename T>
-  // void subtract_in_place(ko::image::image_2d<T> image1, ko::image_image_2d<T> image2) {
-  //   auto image2_data = image2.data();
-  //   image1.parallel_for(KOKKOS_LAMBDA(const size_t x, const int width, view<T**> data, const size_t width, const size_t height) {
-  //     image1_data(x, y) -= image2_data();
-  //   })
-  // }
-
-  template<typename T>
-  void clamp(ko::image::image_2d<T> image, T min, T max) {
-    auto data = image.data();
-    image.parallel_for(KOKKOS_LAMBDA(const int x, const int y) {
-      T val = data(x, y);
-      data(x, y) = Kokkos::clamp(val, min, max);
-    });
-  }
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <element_types.hpp>
+#include <image.hpp>
+#include <frame_pool.hpp>
+#include <type_traits>
+
+namespace ko::maths {
+  // Converts a computed value to an image element type, rounding and saturating for
+  // integer types.
+  template<typename U, typename V>
+  KOKKOS_INLINE_FUNCTION
+  U saturate_cast(V value) {
+    if constexpr (std::is_integral_v<U>) {
+      return static_cast<U>(Kokkos::clamp(Kokkos::round(static_cast<double>(value)),
+        static_cast<double>(Kokkos::Experimental::finite_min_v<U>),
+        static_cast<double>(Kokkos::Experimental::finite_max_v<U>)));
+    } else {
+      return static_cast<U>(value);
+    }
+  }
+
+  template<typename R, typename A, typename B>
+  ko::image::image_2d<R> subtract(ko::image::image_2d<A> image1, ko::image::image_2d<B> image2) {
+    return ko::image::cast<R>(image1) - ko::image::cast<R>(image2);
+  }
+
+  // subtract into an image from pool, for per-frame use without allocating.
+  template<typename R, typename A, typename B>
+  ko::image::image_2d<R> subtract(ko::image::frame_pool<R>& pool, ko::image::image_2d<A> image1, ko::image::image_2d<B> image2) {
+    return pool.acquire(ko::image::cast<R>(image1) - ko::image::cast<R>(image2));
+  }
+
+  template<typename T>
+  void abs_diff(ko::image::image_2d<T> image1, ko::image::image_2d<T> image2, ko::image::image_2d<T> result) {
+    auto image1_data = image1.data();
+    auto image2_data = image2.data();
+    result.parallel_for(KOKKOS_LAMBDA(const int x, const int y, view<T**> data) {
+      data(x, y) = static_cast<T>(Kokkos::abs(image1_data(x, y) - image2_data(x, y)));
+    });
+  }
+
+  template<typename T>
+  ko::image::image_2d<T> abs_diff(ko::image::image_2d<T> image1, ko::image::image_2d<T> image2) {
+    ko::image::image_2d<T> result(image1.width(), image1.height());
+    abs_diff(image1, image2, result);
+    return result;
+  }
+
+  template<typename T>
+  ko::image::image_2d<T> abs_diff(ko::image::frame_pool<T>& pool, ko::image::image_2d<T> image1, ko::image::image_2d<T> image2) {
+    auto result = pool.acquire(image1.width(), image1.height());
+    abs_diff(image1, image2, result);
+    return result;
+  }
+
+  // // TODO: Handle overflow (saturating?)
+  // template<typename T>
+  // void subtract_in_place(ko::image::image_2d<T> image1, ko::image_image_2d<T> image2) {
+  //   auto image2_data = image2.data();
+  //   image1.parallel_for(KOKKOS_LAMBDA(const size_t x, const int width, view<T**> data, const size_t width, const size_t height) {
+  //     image1_data(x, y) -= image2_data();
+  //   })
+  // }
+
+  template<typename T>
+  void clamp(ko::image::image_2d<T> image, T min, T max) {
+    auto data = image.data();
+    image.parallel_for(KOKKOS_LAMBDA(const int x, const int y) {
+      T val = data(x, y);
+      data(x, y) = Kokkos::clamp(val, min, max);
+    });
+  }
+
+  template<typename T>
+  void clamp(ko::image::image_3d<T> stack, T min, T max) {
+    auto data = stack.data();
+    stack.parallel_for(KOKKOS_LAMBDA(const int x, const int y, const int k) {
+      data(x, y, k) = Kokkos::clamp(data(x, y, k), min, max);
+    });
+  }
 }
\ No newline at end of file
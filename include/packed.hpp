@@ -0,0 +1,212 @@
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <maths.hpp>
+#include <transforms.hpp>
+#include <cassert>
+#include <cstdint>
+#include <stdexcept>
+
+// Tightly packed 8, 10, 12, 14 and 16-bit pixels as they come off the detector link:
+// each row starts on a byte boundary and its pixels follow as one little-endian bit
+// stream, least significant bit first. Unpacking and packing work a group of pixels that
+// ends on a byte boundary at a time (4 pixels in 5 bytes at 10 bits, 2 in 3 at 12, 4 in
+// 7 at 14), one group per thread, assembled in a 64-bit register.
+namespace ko::packed {
+  KOKKOS_INLINE_FUNCTION constexpr unsigned group_pixels(unsigned bits) {
+    return bits % 8 == 0 ? 1 : bits % 4 == 0 ? 2 : bits % 2 == 0 ? 4 : 8;
+  }
+
+  KOKKOS_INLINE_FUNCTION constexpr unsigned group_bytes(unsigned bits) { return bits * group_pixels(bits) / 8; }
+
+  class packed_frame {
+    view<uint8_t*> bytes_;
+    size_t width_ = 0;
+    size_t height_ = 0;
+    unsigned bits_ = 0;
+
+    static void check_bits(unsigned bits) {
+      if (bits != 8 && bits != 10 && bits != 12 && bits != 14 && bits != 16) throw std::invalid_argument("Unsupported packed bit depth");
+    }
+
+  public:
+    static size_t row_bytes(size_t width, unsigned bits) { return (width * bits + 7) / 8; }
+
+    packed_frame(size_t width, size_t height, unsigned bits)
+      : bytes_(Kokkos::view_alloc(Kokkos::WithoutInitializing, "packed_frame"), row_bytes(width, bits) * height),
+        width_(width), height_(height), bits_(bits) {
+      check_bits(bits);
+    }
+
+    packed_frame(view<uint8_t*> bytes, size_t width, size_t height, unsigned bits)
+      : bytes_(bytes), width_(width), height_(height), bits_(bits) {
+      check_bits(bits);
+      if (bytes.extent(0) < row_bytes(width, bits) * height) throw std::invalid_argument("Packed buffer too small for frame");
+    }
+
+    size_t width() const { return width_; }
+    size_t height() const { return height_; }
+    unsigned bits() const { return bits_; }
+    size_t row_bytes() const { return row_bytes(width_, bits_); }
+    size_t size_bytes() const { return row_bytes() * height_; }
+    view<uint8_t*> bytes() const { return bytes_; }
+
+    // Copies size_bytes() of packed pixels from host memory, e.g. a frame grabber buffer.
+    void upload(const void* host) const {
+      Kokkos::View<const uint8_t*, Kokkos::HostSpace, Kokkos::MemoryTraits<Kokkos::Unmanaged>> source(static_cast<const uint8_t*>(host), size_bytes());
+      Kokkos::deep_copy(Kokkos::subview(bytes_, Kokkos::make_pair(size_t(0), size_bytes())), source);
+    }
+
+    void download(void* host) const {
+      Kokkos::View<uint8_t*, Kokkos::HostSpace, Kokkos::MemoryTraits<Kokkos::Unmanaged>> destination(static_cast<uint8_t*>(host), size_bytes());
+      Kokkos::deep_copy(destination, Kokkos::subview(bytes_, Kokkos::make_pair(size_t(0), size_bytes())));
+    }
+  };
+
+  // One pixel of a packed row, reading only the bytes it spans.
+  KOKKOS_INLINE_FUNCTION uint16_t extract(const uint8_t* row, size_t x, unsigned bits) {
+    const size_t bit = x * bits;
+    const size_t byte = bit / 8;
+    const unsigned shift = bit % 8;
+    uint32_t word = row[byte];
+    if (shift + bits > 8) word |= uint32_t(row[byte + 1]) << 8;
+    if (shift + bits > 16) word |= uint32_t(row[byte + 2]) << 16;
+    return static_cast<uint16_t>((word >> shift) & ((1u << bits) - 1));
+  }
+
+  // Expression leaf reading pixels straight out of a packed frame, so unpacking fuses
+  // into whatever the expression computes, e.g.
+  //   frame = clamped(unpacked(raw) - dark + offset, min, max);
+  struct packed_terminal {
+    using is_image_expression = void;
+    using value_type = uint16_t;
+    static constexpr bool has_shape = true;
+
+    view<uint8_t*> bytes;
+    size_t w;
+    size_t h;
+    size_t row_bytes;
+    unsigned bits;
+
+    size_t width() const { return w; }
+    size_t height() const { return h; }
+
+    KOKKOS_INLINE_FUNCTION
+    value_type operator()(size_t x, size_t y) const { return extract(bytes.data() + y * row_bytes, x, bits); }
+  };
+
+  inline packed_terminal unpacked(const packed_frame& frame) {
+    return {frame.bytes(), frame.width(), frame.height(), frame.row_bytes(), frame.bits()};
+  }
+
+  namespace packed_detail {
+    template<unsigned Bits>
+    void unpack(const packed_frame& src, ko::image::image_2d<uint16_t> dst) {
+      constexpr unsigned pixels = group_pixels(Bits);
+      constexpr unsigned bytes = group_bytes(Bits);
+      constexpr uint64_t mask = (uint64_t(1) << Bits) - 1;
+      const size_t width = src.width();
+      const size_t row_bytes = src.row_bytes();
+      const size_t groups = (width + pixels - 1) / pixels;
+      auto packed = src.bytes();
+      auto data = dst.data();
+
+      image_policy policy({0, 0}, {groups, src.height()});
+      Kokkos::parallel_for("ko::packed::unpack::parallel_for unpacking pixel groups", policy, KOKKOS_LAMBDA(const size_t g, const size_t y) {
+        const uint8_t* p = packed.data() + y * row_bytes + g * bytes;
+        const size_t x0 = g * pixels;
+        const unsigned count = width - x0 < pixels ? width - x0 : pixels;
+        const unsigned available = (count * Bits + 7) / 8;
+        uint64_t word = 0;
+        for (unsigned b = 0; b < bytes; ++b) {
+          if (b < available) word |= uint64_t(p[b]) << (8 * b);
+        }
+        for (unsigned i = 0; i < pixels; ++i) {
+          if (i < count) data(x0 + i, y) = static_cast<uint16_t>((word >> (i * Bits)) & mask);
+        }
+      });
+    }
+
+    template<unsigned Bits>
+    void pack(const ko::image::image_2d<uint16_t> src, const packed_frame& dst) {
+      constexpr unsigned pixels = group_pixels(Bits);
+      constexpr unsigned bytes = group_bytes(Bits);
+      constexpr uint64_t mask = (uint64_t(1) << Bits) - 1;
+      const size_t width = dst.width();
+      const size_t row_bytes = dst.row_bytes();
+      const size_t groups = (width + pixels - 1) / pixels;
+      auto packed = dst.bytes();
+      auto data = src.data();
+
+      image_policy policy({0, 0}, {groups, dst.height()});
+      Kokkos::parallel_for("ko::packed::pack::parallel_for packing pixel groups", policy, KOKKOS_LAMBDA(const size_t g, const size_t y) {
+        uint8_t* p = packed.data() + y * row_bytes + g * bytes;
+        const size_t x0 = g * pixels;
+        const unsigned count = width - x0 < pixels ? width - x0 : pixels;
+        const unsigned available = (count * Bits + 7) / 8;
+        uint64_t word = 0;
+        for (unsigned i = 0; i < pixels; ++i) {
+          if (i < count) word |= (uint64_t(data(x0 + i, y)) & mask) << (i * Bits);
+        }
+        for (unsigned b = 0; b < bytes; ++b) {
+          if (b < available) p[b] = static_cast<uint8_t>(word >> (8 * b));
+        }
+      });
+    }
+  }
+
+  // Expands src into dst, one pixel group per thread.
+  inline void unpack(const packed_frame& src, ko::image::image_2d<uint16_t> dst) {
+    assert(src.width() == dst.width() && src.height() == dst.height());
+    switch (src.bits()) {
+      case 8: packed_detail::unpack<8>(src, dst); break;
+      case 10: packed_detail::unpack<10>(src, dst); break;
+      case 12: packed_detail::unpack<12>(src, dst); break;
+      case 14: packed_detail::unpack<14>(src, dst); break;
+      default: packed_detail::unpack<16>(src, dst); break;
+    }
+  }
+
+  // Packs the low dst.bits() bits of each pixel of src into dst.
+  inline void pack(const ko::image::image_2d<uint16_t> src, const packed_frame& dst) {
+    assert(src.width() == dst.width() && src.height() == dst.height());
+    switch (dst.bits()) {
+      case 8: packed_detail::pack<8>(src, dst); break;
+      case 10: packed_detail::pack<10>(src, dst); break;
+      case 12: packed_detail::pack<12>(src, dst); break;
+      case 14: packed_detail::pack<14>(src, dst); break;
+      default: packed_detail::pack<16>(src, dst); break;
+    }
+  }
+
+  // ko::transforms::flat_field_correction reading its input from a packed frame, so the
+  // unpacked frame is written once, already corrected.
+  template<typename D, typename G>
+  void flat_field_correction(
+    const packed_frame& input,
+    ko::image::image_2d<uint16_t> output,
+    ko::image::image_2d<D> dark,
+    ko::image::image_2d<G> normed_gain,
+    uint16_t offset,
+    uint16_t min,
+    uint16_t max,
+    const Kokkos::DefaultExecutionSpace& space = {}
+  ) {
+    assert(input.width() == output.width() && input.height() == output.height());
+    assert(input.width() == dark.width() && input.height() == dark.height());
+    assert(input.width() == normed_gain.width() && input.height() == normed_gain.height());
+
+    const ko::transforms::pixel_correction<uint16_t, ko::maths::compute_type_t<uint16_t, D, G>> correction(offset, min, max);
+    auto raw = unpacked(input);
+    auto data = output.data();
+    auto dark_data = dark.data();
+    auto normed_gain_data = normed_gain.data();
+
+    Kokkos::parallel_for("ko::packed::flat_field_correction::parallel_for correcting packed pixels",
+      image_policy(space, {0, 0}, {output.width(), output.height()}),
+      KOKKOS_LAMBDA(const size_t x, const size_t y) {
+        data(x, y) = correction.flat_field_corrected(raw(x, y), dark_data(x, y), normed_gain_data(x, y));
+    });
+  }
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <algorithm>
+#include <future>
+#include <type_traits>
+#include <vector>
+
+namespace ko::pipeline {
+  // Host side of a frame slot. Pinned where the backend has pinned memory so copies on an
+  // execution space instance run asynchronously.
+  template<typename T>
+  using staging_view = Kokkos::View<T**, typename view<T**>::array_layout, Kokkos::SharedHostPinnedSpace>;
+
+  // Streams frames through decode -> upload -> process -> download -> encode with depth
+  // (at least 3) frame slots, so that while frame i is processed frame i + 1 is decoded
+  // and uploaded and frame i - 1 is downloaded and encoded. Uploads, processing and
+  // downloads are issued on three execution space instances and only fenced where a
+  // later step needs their result; decode and encode run on worker threads. On host
+  // backends the staging buffers are the frames themselves, which leaves decode, compute
+  // and encode overlapping on separate threads.
+  template<typename T>
+  class frame_pipeline {
+    static constexpr bool staging_is_frame =
+      std::is_same_v<Kokkos::SharedHostPinnedSpace, typename Kokkos::DefaultExecutionSpace::memory_space>;
+
+    struct slot {
+      staging_view<T> host;
+      ko::image::image_2d<T> frame;
+    };
+
+    std::vector<slot> slots_;
+    Kokkos::DefaultExecutionSpace upload_space_;
+    Kokkos::DefaultExecutionSpace compute_space_;
+    Kokkos::DefaultExecutionSpace download_space_;
+
+    void upload(slot& s) {
+      if constexpr (!staging_is_frame) Kokkos::deep_copy(upload_space_, s.frame.data(), s.host);
+    }
+
+    void download(slot& s) {
+      if constexpr (!staging_is_frame) Kokkos::deep_copy(download_space_, s.host, s.frame.data());
+    }
+
+  public:
+    frame_pipeline(size_t width, size_t height, size_t depth = 3) {
+      auto instances = Kokkos::Experimental::partition_space(Kokkos::DefaultExecutionSpace(), 1, 1, 1);
+      upload_space_ = instances[0];
+      compute_space_ = instances[1];
+      download_space_ = instances[2];
+
+      depth = std::max<size_t>(depth, 3);
+      slots_.reserve(depth);
+      for (size_t i = 0; i < depth; ++i) {
+        ko::image::image_2d<T> frame(width, height);
+        staging_view<T> host;
+        if constexpr (staging_is_frame) {
+          host = frame.data();
+        } else {
+          host = staging_view<T>(Kokkos::view_alloc(Kokkos::WithoutInitializing, "frame_pipeline staging"), width, height);
+        }
+        slots_.push_back({host, frame});
+      }
+    }
+
+    size_t depth() const { return slots_.size(); }
+
+    // source(staging_view<T>) fills the next frame and returns false once there are none
+    // left. process(image_2d<T>, const Kokkos::DefaultExecutionSpace&) works on the
+    // device frame and must launch its kernels on the instance it is given, e.g.
+    // calibrated_detector::correct(frame, space). Temporaries it takes from a frame_pool
+    // must be acquired for that instance too. sink(staging_view<T>, index) consumes the
+    // processed frame. Returns the number of frames processed.
+    //
+    // Frame i's slot is reused for frame i + depth, and depth >= 3 keeps every step of
+    // an iteration on a different slot: process(i) runs alongside source(i + 1),
+    // upload(i + 1), sink(i - 1) and the download of i - 1 issued an iteration earlier,
+    // and sink(i - 2) has finished before source(i + 1) writes the host buffer it read.
+    template<typename Source, typename Process, typename Sink>
+    size_t run(Source source, Process process, Sink sink) {
+      const size_t depth = slots_.size();
+      std::future<bool> reading;
+      std::future<void> writing;
+
+      if (!source(slots_[0].host)) return 0;
+      upload(slots_[0]);
+
+      size_t i = 0;
+      for (bool more = true; more; ++i) {
+        slot& current = slots_[i % depth];
+        slot& next = slots_[(i + 1) % depth];
+
+        // sink(i - 2) has released next.host, so frame i + 1 can be decoded into it
+        // while frame i, now on the device, is processed.
+        upload_space_.fence();
+        if (writing.valid()) writing.get();
+        reading = std::async(std::launch::async, [&source, &next] { return source(next.host); });
+        process(current.frame, compute_space_);
+
+        if (i > 0) {
+          download_space_.fence();
+          slot& previous = slots_[(i - 1) % depth];
+          writing = std::async(std::launch::async, [&sink, &previous, i] { sink(previous.host, i - 1); });
+        }
+
+        more = reading.get();
+        if (more) upload(next);
+
+        // Only the download of frame i waits for its processing.
+        compute_space_.fence();
+        download(current);
+      }
+
+      download_space_.fence();
+      if (writing.valid()) writing.get();
+      sink(slots_[(i - 1) % depth].host, i - 1);
+      return i;
+    }
+  };
+}
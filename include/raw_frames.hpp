@@ -0,0 +1,144 @@
+#pragma once
+
+#include <image.hpp>
+#include <io.hpp>
+#include <mapped_file.hpp>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+// Raw frame sequence files: a raw_header followed by frame_count frames of width x height
+// little-endian pixels, row-major, each pixel in an 8 or 16-bit word depending on
+// bit_depth. Readers map the file so frames come straight out of the page cache.
+namespace ko::io {
+  // Frames are mapped and used in place, so the file's little-endian layout has to be the
+  // host's.
+  static_assert(std::endian::native == std::endian::little, "raw frame files are little-endian");
+
+  struct raw_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bit_depth;
+    uint32_t reserved;
+    uint64_t frame_count;
+  };
+  static_assert(sizeof(raw_header) == 40);
+
+  inline constexpr char raw_magic[8] = {'K', 'O', 'R', 'A', 'W', 'F', 'R', '\0'};
+  inline constexpr uint32_t raw_version = 1;
+
+  inline size_t raw_bytes_per_pixel(uint32_t bit_depth) { return bit_depth <= 8 ? 1 : 2; }
+
+  template<typename T>
+  class raw_frame_reader {
+    mapped_file file_;
+    raw_header header_;
+
+    size_t frame_bytes() const { return static_cast<size_t>(header_.width) * header_.height * sizeof(T); }
+
+    T* frame_data(size_t index) const {
+      if (index >= header_.frame_count) throw std::out_of_range("Raw frame index out of range");
+      return reinterpret_cast<T*>(file_.data() + header_.header_size + index * frame_bytes());
+    }
+
+  public:
+    explicit raw_frame_reader(const std::string& path)
+      : file_(path) {
+      if (file_.size() < sizeof(raw_header)) throw std::runtime_error("Not a raw frame file: " + path);
+      std::memcpy(&header_, file_.data(), sizeof(raw_header));
+      if (std::memcmp(header_.magic, raw_magic, sizeof(raw_magic)) != 0 || header_.version != raw_version) {
+        throw std::runtime_error("Not a raw frame file: " + path);
+      }
+      if (raw_bytes_per_pixel(header_.bit_depth) != sizeof(T)) {
+        throw std::runtime_error("Raw frame pixel size doesn't match element type: " + path);
+      }
+      // Frames are read in place as T, so they must start aligned within the mapping.
+      if (header_.header_size < sizeof(raw_header) || header_.header_size % alignof(T) != 0) {
+        throw std::runtime_error("Bad raw frame header size: " + path);
+      }
+      if (header_.header_size > file_.size() ||
+          (frame_bytes() != 0 && header_.frame_count > (file_.size() - header_.header_size) / frame_bytes())) {
+        throw std::runtime_error("Truncated raw frame file: " + path);
+      }
+    }
+
+    size_t width() const { return header_.width; }
+    size_t height() const { return header_.height; }
+    size_t bit_depth() const { return header_.bit_depth; }
+    size_t frame_count() const { return header_.frame_count; }
+
+    // Host view of a mapped frame. Valid while the reader is alive; writes stay private.
+    host_view<T> frame(size_t index) const {
+      return host_view<T>(frame_data(index), header_.width, header_.height);
+    }
+
+    void prefetch(size_t index) const {
+      if (index < header_.frame_count) file_.prefetch(header_.header_size + index * frame_bytes(), frame_bytes());
+    }
+
+    // Image over the mapped frame with no copy, where image storage is host memory.
+    ko::image::image_2d<T> frame_image(size_t index) const {
+      static_assert(mat_compatible<T>, "image_2d storage isn't host memory on this backend, use read_frame");
+      return ko::image::image_2d<T>(view<T**>(frame_data(index), header_.width, header_.height));
+    }
+
+    void read_frame(size_t index, ko::image::image_2d<T> dst) const {
+      copy_from_host(dst, frame(index));
+    }
+  };
+
+  template<typename T>
+  class raw_frame_writer {
+    std::ofstream file_;
+    raw_header header_;
+    host_view<T> staging_;
+
+    void write_header() {
+      file_.seekp(0);
+      file_.write(reinterpret_cast<const char*>(&header_), sizeof(raw_header));
+    }
+
+  public:
+    raw_frame_writer(const std::string& path, size_t width, size_t height, uint32_t bit_depth = 8 * sizeof(T))
+      : file_(path, std::ios::binary | std::ios::trunc),
+        header_{},
+        staging_(Kokkos::view_alloc(Kokkos::WithoutInitializing, "raw_frame_writer staging"), width, height) {
+      if (!file_) throw std::runtime_error("Failed to open: " + path);
+      if (raw_bytes_per_pixel(bit_depth) != sizeof(T)) throw std::runtime_error("Bit depth doesn't match element type");
+      std::memcpy(header_.magic, raw_magic, sizeof(raw_magic));
+      header_.version = raw_version;
+      header_.header_size = sizeof(raw_header);
+      header_.width = width;
+      header_.height = height;
+      header_.bit_depth = bit_depth;
+      write_header();
+    }
+
+    raw_frame_writer(const raw_frame_writer&) = delete;
+    raw_frame_writer& operator=(const raw_frame_writer&) = delete;
+
+    ~raw_frame_writer() {
+      if (file_.is_open()) close();
+    }
+
+    size_t frame_count() const { return header_.frame_count; }
+
+    void write(const ko::image::image_2d<T> frame) {
+      copy_to_host(staging_, frame);
+      file_.write(reinterpret_cast<const char*>(staging_.data()), staging_.size() * sizeof(T));
+      if (!file_) throw std::runtime_error("Failed to write raw frame");
+      header_.frame_count += 1;
+    }
+
+    void close() {
+      write_header();
+      file_.close();
+    }
+  };
+}
@@ -1,40 +1,282 @@
-#pragma once
-
-#include <concepts.hpp>
-#include <kokkos_types.hpp>
-#include <image.hpp>
-#include <iostream>
-
-namespace ko::statistics {
-  template<typename T>
-  double mean(const ko::image::image_2d<T> img) {
-      auto data = img.data();
-      double sum_value = 0.0;
-      img.parallel_reduce(KOKKOS_LAMBDA(const int x, const int y, double& local_sum) {
-          local_sum += static_cast<double>(data(x, y));
-      }, Kokkos::Sum<double>(sum_value));
-      return sum_value / img.element_count();
-  }
-
-  template<typename T, typename Comparator>
-  size_t count(const ko::image::image_2d<T> image, Comparator comp) {
-    size_t count;
-    auto data = image.data();
-    image.parallel_reduce(KOKKOS_LAMBDA(const int x, const int y, size_t& local_count) {
-        if (comp(data(x, y))) local_count += 1;
-    }, Kokkos::Sum<size_t>(count));
-    return count;
-  }
-
-  template<typename T>
-  void simple_histogram(view<int*> histogram, ko::image::image_2d<T> input, T min, T max) {
-    Kokkos::MDRangePolicy<Kokkos::Rank<2>> policy({0, 0}, {input.width(), input.height()});
-
-    auto data = input.data();
-
-    Kokkos::parallel_for("ko::statistics::simple_histogram parallel for", policy, KOKKOS_LAMBDA(const int x, const int y) {
-      int index = (1.0*(data(x, y)-min)/(max-min)) * histogram.extent(0);
-      Kokkos::atomic_increment(&histogram(index));
-    });  
-  }
+#pragma once
+
+#include <concepts.hpp>
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <algorithm>
+#include <iostream>
+#include <type_traits>
+
+namespace ko::statistics {
+  template<typename T>
+  double mean(const ko::image::image_2d<T> img) {
+      auto data = img.data();
+      double sum_value = 0.0;
+      img.parallel_reduce(KOKKOS_LAMBDA(const int x, const int y, double& local_sum) {
+          local_sum += static_cast<double>(data(x, y));
+      }, Kokkos::Sum<double>(sum_value));
+      return sum_value / img.element_count();
+  }
+
+  template<typename T, typename Comparator>
+  size_t count(const ko::image::image_2d<T> image, Comparator comp) {
+    size_t count;
+    auto data = image.data();
+    image.parallel_reduce(KOKKOS_LAMBDA(const int x, const int y, size_t& local_count) {
+        if (comp(data(x, y))) local_count += 1;
+    }, Kokkos::Sum<size_t>(count));
+    return count;
+  }
+
+  namespace statistics_detail {
+    using team_policy = Kokkos::TeamPolicy<>;
+    using team_member = typename team_policy::member_type;
+
+    // Blocks of pixels_per_team pixels, each of a single frame, for per-frame reductions
+    // over a stack: small frames still spread over many teams and a team's partial
+    // result goes to one frame.
+    struct stack_blocks {
+      size_t width;
+      size_t pixel_count;
+      size_t pixels_per_team;
+      size_t blocks_per_frame;
+
+      template<typename T>
+      stack_blocks(const ko::image::image_3d<T>& stack, size_t pixels_per_team)
+        : width(stack.width()),
+          pixel_count(stack.width() * stack.height()),
+          pixels_per_team(pixels_per_team),
+          blocks_per_frame((pixel_count + pixels_per_team - 1) / pixels_per_team) {}
+
+      size_t league_size(size_t depth) const { return blocks_per_frame * depth; }
+
+      KOKKOS_INLINE_FUNCTION size_t frame(const team_member& team) const { return team.league_rank() / blocks_per_frame; }
+      KOKKOS_INLINE_FUNCTION size_t begin(const team_member& team) const { return (team.league_rank() % blocks_per_frame) * pixels_per_team; }
+      KOKKOS_INLINE_FUNCTION size_t end(const team_member& team) const { return Kokkos::min(begin(team) + pixels_per_team, pixel_count); }
+    };
+
+    using bin_scratch = Kokkos::View<int*, Kokkos::DefaultExecutionSpace::scratch_memory_space, Kokkos::MemoryTraits<Kokkos::Unmanaged>>;
+
+    // Pixels a histogram team counts, rounded to whole rows.
+    inline constexpr int pixels_per_histogram_team = 1 << 15;
+
+    // Bins a histogram team can keep in level 0 scratch, halving bin_count until they fit.
+    inline int bins_per_team(int bin_count) {
+      int bins = bin_count;
+      while (bins > 1 && bin_scratch::shmem_size(bins) > static_cast<size_t>(team_policy::scratch_size_max(0))) bins = (bins + 1) / 2;
+      return bins;
+    }
+
+    // sums(k) = sum of f(x, y, k) over frame k, for every frame in one launch.
+    template<typename R, typename T, typename F>
+    void frame_sums(const ko::image::image_3d<T> stack, view<R*> sums, F f, size_t pixels_per_team) {
+      assert(sums.extent(0) == stack.depth());
+      Kokkos::deep_copy(sums, R(0));
+      const stack_blocks blocks(stack, pixels_per_team);
+      if (blocks.league_size(stack.depth()) == 0) return;
+
+      Kokkos::parallel_for("ko::statistics::frame_sums parallel for", team_policy(blocks.league_size(stack.depth()), Kokkos::AUTO),
+        KOKKOS_LAMBDA(const team_member& team) {
+          const size_t k = blocks.frame(team);
+          R sum = 0;
+          Kokkos::parallel_reduce(Kokkos::TeamThreadRange(team, blocks.begin(team), blocks.end(team)), [&](const size_t i, R& local_sum) {
+            local_sum += f(i % blocks.width, i / blocks.width, k);
+          }, sum);
+          Kokkos::single(Kokkos::PerTeam(team), [&]() {
+            Kokkos::atomic_add(&sums(k), sum);
+          });
+      });
+    }
+  }
+
+  // Per-frame mean of a stack, means(k) for frame k.
+  template<typename T>
+  void mean(const ko::image::image_3d<T> stack, view<double*> means, size_t pixels_per_team = 1 << 14) {
+    auto data = stack.data();
+    const double scale = 1.0 / (stack.width() * stack.height());
+    statistics_detail::frame_sums<double>(stack, means, KOKKOS_LAMBDA(const size_t x, const size_t y, const size_t k) {
+      return static_cast<double>(data(x, y, k)) * scale;
+    }, pixels_per_team);
+  }
+
+  template<typename T>
+  view<double*> mean(const ko::image::image_3d<T> stack) {
+    view<double*> means("frame means", stack.depth());
+    mean(stack, means);
+    return means;
+  }
+
+  // Per-frame count of the pixels comp accepts, counts(k) for frame k.
+  template<typename T, typename Comparator>
+  void count(const ko::image::image_3d<T> stack, Comparator comp, view<size_t*> counts, size_t pixels_per_team = 1 << 14) {
+    auto data = stack.data();
+    statistics_detail::frame_sums<size_t>(stack, counts, KOKKOS_LAMBDA(const size_t x, const size_t y, const size_t k) {
+      return comp(data(x, y, k)) ? size_t(1) : size_t(0);
+    }, pixels_per_team);
+  }
+
+  template<typename T, typename Comparator>
+  view<size_t*> count(const ko::image::image_3d<T> stack, Comparator comp) {
+    view<size_t*> counts("frame counts", stack.depth());
+    count(stack, comp, counts);
+    return counts;
+  }
+
+  // Maps a value in [min, max] to one of bin_count equal width bins, or -1 when it is out
+  // of range. Integer ranges are inclusive of max so e.g. [0, 16383] over 16384 bins gives
+  // one bin per value.
+  template<typename T>
+  struct histogram_binning {
+    double min;
+    double max;
+    double scale;
+    int bin_count;
+
+    histogram_binning(T min, T max, int bin_count)
+      : min(static_cast<double>(min)), max(static_cast<double>(max)), bin_count(bin_count) {
+      double range = this->max - this->min + (std::is_integral_v<T> ? 1.0 : 0.0);
+      scale = range > 0.0 ? bin_count / range : 0.0;
+    }
+
+    KOKKOS_INLINE_FUNCTION
+    int operator()(T value) const {
+      const double val = static_cast<double>(value);
+      if (val < min || val > max) return -1;
+      const int index = static_cast<int>((val - min) * scale);
+      return index < bin_count ? index : bin_count - 1;
+    }
+  };
+
+  template<typename T>
+  void simple_histogram(view<int*> histogram, ko::image::image_2d<T> input, T min, T max) {
+    image_policy policy({0, 0}, {input.width(), input.height()});
+
+    auto data = input.data();
+    histogram_binning<T> binning(min, max, histogram.extent(0));
+
+    Kokkos::parallel_for("ko::statistics::simple_histogram parallel for", policy, KOKKOS_LAMBDA(const int x, const int y) {
+      int index = binning(data(x, y));
+      if (index >= 0) Kokkos::atomic_increment(&histogram(index));
+    });  
+  }
+
+  // Histogram of input over [min, max] into histogram.extent(0) bins, overwriting it.
+  // Each team counts a block of rows into private bins in level 0 scratch and then merges
+  // the non-empty ones, so global atomics are per team and bin instead of per pixel and
+  // hot bins don't serialise the whole frame. Bins that don't fit in level 0 are split
+  // into ranges, each counted by its own teams.
+  template<typename T>
+  void histogram(
+    view<int*> histogram,
+    const ko::image::image_2d<T> input,
+    T min,
+    T max,
+    const Kokkos::DefaultExecutionSpace& space = {}
+  ) {
+    using statistics_detail::team_policy;
+    using statistics_detail::team_member;
+    using statistics_detail::bin_scratch;
+
+    const int bin_count = histogram.extent(0);
+    const int width = input.width();
+    const int height = input.height();
+    const int bins_per_team = statistics_detail::bins_per_team(bin_count);
+    const int bin_ranges = (bin_count + bins_per_team - 1) / bins_per_team;
+    const int rows_per_team = std::max(1, statistics_detail::pixels_per_histogram_team / std::max(width, 1));
+    const int row_blocks = (height + rows_per_team - 1) / rows_per_team;
+
+    auto data = input.data();
+    histogram_binning<T> binning(min, max, bin_count);
+
+    Kokkos::deep_copy(space, histogram, 0);
+    if (width == 0 || height == 0 || bin_count == 0) return;
+
+    team_policy policy(space, row_blocks * bin_ranges, Kokkos::AUTO);
+    policy.set_scratch_size(0, Kokkos::PerTeam(bin_scratch::shmem_size(bins_per_team)));
+
+    Kokkos::parallel_for("ko::statistics::histogram parallel for", policy, KOKKOS_LAMBDA(const team_member& team) {
+      const int first_bin = team.league_rank() % bin_ranges * bins_per_team;
+      const int bins_here = Kokkos::min(bins_per_team, bin_count - first_bin);
+      const int first_row = team.league_rank() / bin_ranges * rows_per_team;
+      const int end_row = Kokkos::min(first_row + rows_per_team, height);
+      bin_scratch bins(team.team_scratch(0), bins_here);
+
+      Kokkos::parallel_for(Kokkos::TeamThreadRange(team, bins_here), [&](const int i) {
+        bins(i) = 0;
+      });
+      team.team_barrier();
+
+      for (int y = first_row; y < end_row; ++y) {
+        Kokkos::parallel_for(Kokkos::TeamThreadRange(team, width), [&](const int x) {
+          const int index = binning(data(x, y)) - first_bin;
+          if (index >= 0 && index < bins_here) Kokkos::atomic_increment(&bins(index));
+        });
+      }
+      team.team_barrier();
+
+      Kokkos::parallel_for(Kokkos::TeamThreadRange(team, bins_here), [&](const int i) {
+        if (bins(i) != 0) Kokkos::atomic_add(&histogram(first_bin + i), bins(i));
+      });
+    });
+  }
+
+  // Per-frame histograms of a stack, histograms(i, k) for bin i of frame k, overwriting
+  // them. Works like histogram() with every team's rows inside one frame.
+  template<typename T>
+  void histogram(
+    view<int**> histograms,
+    const ko::image::image_3d<T> stack,
+    T min,
+    T max
+  ) {
+    using statistics_detail::team_policy;
+    using statistics_detail::team_member;
+    using statistics_detail::bin_scratch;
+
+    assert(histograms.extent(1) == stack.depth());
+    const int bin_count = histograms.extent(0);
+    const int width = stack.width();
+    const int height = stack.height();
+    const int depth = stack.depth();
+    const int bins_per_team = statistics_detail::bins_per_team(bin_count);
+    const int bin_ranges = (bin_count + bins_per_team - 1) / bins_per_team;
+    const int rows_per_team = std::max(1, statistics_detail::pixels_per_histogram_team / std::max(width, 1));
+    const int row_blocks = (height + rows_per_team - 1) / rows_per_team;
+
+    auto data = stack.data();
+    histogram_binning<T> binning(min, max, bin_count);
+
+    Kokkos::deep_copy(histograms, 0);
+    if (width == 0 || height == 0 || depth == 0 || bin_count == 0) return;
+
+    team_policy policy(row_blocks * bin_ranges * depth, Kokkos::AUTO);
+    policy.set_scratch_size(0, Kokkos::PerTeam(bin_scratch::shmem_size(bins_per_team)));
+
+    Kokkos::parallel_for("ko::statistics::histogram parallel for across stack", policy, KOKKOS_LAMBDA(const team_member& team) {
+      const int block = team.league_rank() % (row_blocks * bin_ranges);
+      const int k = team.league_rank() / (row_blocks * bin_ranges);
+      const int first_bin = block % bin_ranges * bins_per_team;
+      const int bins_here = Kokkos::min(bins_per_team, bin_count - first_bin);
+      const int first_row = block / bin_ranges * rows_per_team;
+      const int end_row = Kokkos::min(first_row + rows_per_team, height);
+      bin_scratch bins(team.team_scratch(0), bins_here);
+
+      Kokkos::parallel_for(Kokkos::TeamThreadRange(team, bins_here), [&](const int i) {
+        bins(i) = 0;
+      });
+      team.team_barrier();
+
+      for (int y = first_row; y < end_row; ++y) {
+        Kokkos::parallel_for(Kokkos::TeamThreadRange(team, width), [&](const int x) {
+          const int index = binning(data(x, y, k)) - first_bin;
+          if (index >= 0 && index < bins_here) Kokkos::atomic_increment(&bins(index));
+        });
+      }
+      team.team_barrier();
+
+      Kokkos::parallel_for(Kokkos::TeamThreadRange(team, bins_here), [&](const int i) {
+        if (bins(i) != 0) Kokkos::atomic_add(&histograms(first_bin + i, k), bins(i));
+      });
+    });
+  }
 }
\ No newline at end of file
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <maths.hpp>
+
+namespace ko::stencil {
+  template<typename T>
+  using tile_view = Kokkos::View<T**, Kokkos::LayoutLeft, Kokkos::DefaultExecutionSpace::scratch_memory_space, Kokkos::MemoryTraits<Kokkos::Unmanaged>>;
+
+  // What an operation sees for one output pixel: the scratch tile around it, addressed
+  // by offsets from the centre in [-radius, radius]. x and y are the pixel's position in
+  // the input image, frame_x and frame_y its position in the frame the input was cut
+  // from, which are the same unless the input is a region of interest.
+  template<typename T>
+  struct neighbourhood {
+    tile_view<T> tile;
+    int tile_x;
+    int tile_y;
+    int x;
+    int y;
+    int width;
+    int height;
+    int frame_x;
+    int frame_y;
+    int frame_width;
+    int frame_height;
+    int radius;
+    ko::image::border_mode border;
+
+    KOKKOS_INLINE_FUNCTION
+    T operator()(int dx, int dy) const { return tile(tile_x + dx, tile_y + dy); }
+
+    KOKKOS_INLINE_FUNCTION
+    T centre() const { return tile(tile_x, tile_y); }
+
+    // Whether the offset is a real pixel of the frame rather than a border sample.
+    KOKKOS_INLINE_FUNCTION
+    bool in_bounds(int dx, int dy) const {
+      return frame_x + dx >= 0 && frame_x + dx < frame_width && frame_y + dy >= 0 && frame_y + dy < frame_height;
+    }
+
+    // Whether the offset lies inside the input image itself.
+    KOKKOS_INLINE_FUNCTION
+    bool in_image(int dx, int dy) const {
+      return x + dx >= 0 && x + dx < width && y + dy >= 0 && y + dy < height;
+    }
+
+    // False for offsets that should be left out of the operation under a valid border.
+    KOKKOS_INLINE_FUNCTION
+    bool sampled(int dx, int dy) const {
+      return border != ko::image::border_mode::valid || in_bounds(dx, dy);
+    }
+  };
+
+  constexpr int tile_width = 32;
+  constexpr int tile_height = 8;
+
+  // Runs op for every pixel of input, writing to output. Each team stages one tile plus a
+  // radius wide halo in scratch memory, loading every input pixel once per tile, and then
+  // evaluates op(const neighbourhood<T>&) for the pixels of the tile. When input is a
+  // region of interest the halo comes from the surrounding frame. output must not alias
+  // input.
+  template<typename T, typename U, typename Op>
+  void apply(
+    const ko::image::image_2d<T> input,
+    ko::image::image_2d<U> output,
+    int radius,
+    Op op,
+    ko::image::border_mode border = ko::image::border_mode::replicate
+  ) {
+    using team_policy = Kokkos::TeamPolicy<>;
+    using team_member = typename team_policy::member_type;
+    using ko::image::border_index;
+
+    const int width = input.width();
+    const int height = input.height();
+    const int origin_x = input.x_offset();
+    const int origin_y = input.y_offset();
+    const int frame_width = input.frame().extent(0);
+    const int frame_height = input.frame().extent(1);
+    const int tiles_x = (width + tile_width - 1) / tile_width;
+    const int tiles_y = (height + tile_height - 1) / tile_height;
+    const int halo_width = tile_width + 2 * radius;
+    const int halo_height = tile_height + 2 * radius;
+    const size_t scratch_size = tile_view<T>::shmem_size(halo_width, halo_height);
+    const int scratch_level = scratch_size <= static_cast<size_t>(team_policy::scratch_size_max(0)) ? 0 : 1;
+
+    auto frame_data = input.frame();
+    auto output_data = output.data();
+
+    if (tiles_x == 0 || tiles_y == 0) return;
+
+    team_policy policy(tiles_x * tiles_y, Kokkos::AUTO);
+    policy.set_scratch_size(scratch_level, Kokkos::PerTeam(scratch_size));
+
+    Kokkos::parallel_for("ko::stencil::apply parallel for", policy, KOKKOS_LAMBDA(const team_member& team) {
+      const int x0 = (team.league_rank() % tiles_x) * tile_width;
+      const int y0 = (team.league_rank() / tiles_x) * tile_height;
+      tile_view<T> tile(team.team_scratch(scratch_level), halo_width, halo_height);
+
+      Kokkos::parallel_for(Kokkos::TeamThreadRange(team, halo_width * halo_height), [&](const int i) {
+        const int tx = i % halo_width;
+        const int ty = i / halo_width;
+        const int ix = border_index(origin_x + x0 - radius + tx, frame_width, border);
+        const int iy = border_index(origin_y + y0 - radius + ty, frame_height, border);
+        tile(tx, ty) = ix < 0 || iy < 0 ? T(0) : frame_data(ix, iy);
+      });
+      team.team_barrier();
+
+      Kokkos::parallel_for(Kokkos::TeamThreadRange(team, tile_width * tile_height), [&](const int i) {
+        const int tx = i % tile_width;
+        const int ty = i / tile_width;
+        const int x = x0 + tx;
+        const int y = y0 + ty;
+        if (x < width && y < height) {
+          neighbourhood<T> n{tile, tx + radius, ty + radius, x, y, width, height, origin_x + x, origin_y + y, frame_width, frame_height, radius, border};
+          output_data(x, y) = ko::maths::saturate_cast<U>(op(n));
+        }
+      });
+    });
+  }
+
+  struct mean_op {
+    template<typename T>
+    KOKKOS_INLINE_FUNCTION
+    float operator()(const neighbourhood<T>& n) const {
+      float sum = 0.0f;
+      int count = 0;
+      for (int dy = -n.radius; dy <= n.radius; ++dy)
+        for (int dx = -n.radius; dx <= n.radius; ++dx)
+          if (n.sampled(dx, dy)) {
+            sum += static_cast<float>(n(dx, dy));
+            ++count;
+          }
+      return sum / count;
+    }
+  };
+
+  // Weighted mean with a (2 * radius + 1)^2 kernel, e.g. a gaussian. Weights of samples
+  // left out by the border are dropped from the normalisation.
+  struct convolution_op {
+    view<double**> kernel;
+
+    template<typename T>
+    KOKKOS_INLINE_FUNCTION
+    float operator()(const neighbourhood<T>& n) const {
+      float sum = 0.0f;
+      float weight_sum = 0.0f;
+      for (int dy = -n.radius; dy <= n.radius; ++dy)
+        for (int dx = -n.radius; dx <= n.radius; ++dx)
+          if (n.sampled(dx, dy)) {
+            const float weight = kernel(dx + n.radius, dy + n.radius);
+            sum += weight * static_cast<float>(n(dx, dy));
+            weight_sum += weight;
+          }
+      return weight_sum != 0.0f ? sum / weight_sum : static_cast<float>(n.centre());
+    }
+  };
+
+  struct erode_op {
+    template<typename T>
+    KOKKOS_INLINE_FUNCTION
+    T operator()(const neighbourhood<T>& n) const {
+      T value = n.centre();
+      for (int dy = -n.radius; dy <= n.radius; ++dy)
+        for (int dx = -n.radius; dx <= n.radius; ++dx)
+          if (n.sampled(dx, dy)) value = Kokkos::min(value, n(dx, dy));
+      return value;
+    }
+  };
+
+  struct dilate_op {
+    template<typename T>
+    KOKKOS_INLINE_FUNCTION
+    T operator()(const neighbourhood<T>& n) const {
+      T value = n.centre();
+      for (int dy = -n.radius; dy <= n.radius; ++dy)
+        for (int dx = -n.radius; dx <= n.radius; ++dx)
+          if (n.sampled(dx, dy)) value = Kokkos::max(value, n(dx, dy));
+      return value;
+    }
+  };
+
+  // Replaces pixels flagged in defect_map with the kernel weighted mean of their
+  // non-defective neighbours and passes other pixels through. defect_map covers the
+  // input image, so neighbours outside it are left out.
+  template<typename M>
+  struct defect_interpolation_op {
+    view<M**> defect_map;
+    view<double**> kernel;
+
+    template<typename T>
+    KOKKOS_INLINE_FUNCTION
+    float operator()(const neighbourhood<T>& n) const {
+      if (defect_map(n.x, n.y) == 0) return static_cast<float>(n.centre());
+
+      float sum = 0.0f;
+      float weight_sum = 0.0f;
+      for (int dy = -n.radius; dy <= n.radius; ++dy)
+        for (int dx = -n.radius; dx <= n.radius; ++dx)
+          if (n.in_image(dx, dy) && defect_map(n.x + dx, n.y + dy) == 0) {
+            const float weight = kernel(dx + n.radius, dy + n.radius);
+            sum += weight * static_cast<float>(n(dx, dy));
+            weight_sum += weight;
+          }
+      return weight_sum > 0.0f ? sum / weight_sum : static_cast<float>(n.centre());
+    }
+  };
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <Kokkos_Random.hpp>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Synthetic detector frames for benchmarking without calibration data on disk. A frame is
+// dark + gain * Poisson(flux * scene) + read noise, with the dark, gain, defects and a
+// PCB-like scene fixed when the source is built and the noise drawn per frame from a
+// Kokkos::Random pool.
+namespace ko::synthetic {
+  struct synthetic_settings {
+    size_t width = 2802;
+    size_t height = 2400;
+    double max = 16383;
+    double dark_level = 300;
+    double dark_spread = 12;        // per pixel
+    double column_spread = 6;       // per column
+    double gain_spread = 0.04;
+    double vignetting = 0.25;       // gain fall-off at the corners
+    double flux = 3000;             // photons per pixel through bare board
+    double read_noise = 3;
+    double defect_fraction = 2e-4;  // half stuck dark, half stuck bright
+    uint64_t seed = 20240601;
+  };
+
+  enum defect_kind : uint8_t { no_defect = 0, dead_pixel = 1, hot_pixel = 2 };
+
+  namespace synthetic_detail {
+    KOKKOS_INLINE_FUNCTION uint32_t hash(uint32_t x) {
+      x ^= x >> 16;
+      x *= 0x7feb352du;
+      x ^= x >> 15;
+      x *= 0x846ca68bu;
+      x ^= x >> 16;
+      return x;
+    }
+
+    // Knuth's method for small means, a rounded normal approximation above.
+    template<typename Generator>
+    KOKKOS_INLINE_FUNCTION double poisson(Generator& generator, double mean) {
+      if (mean < 30.0) {
+        const double limit = Kokkos::exp(-mean);
+        double product = generator.drand();
+        int k = 0;
+        while (product > limit) {
+          product *= generator.drand();
+          k += 1;
+        }
+        return k;
+      }
+      return Kokkos::fmax(0.0, Kokkos::round(generator.normal(mean, Kokkos::sqrt(mean))));
+    }
+
+    // Transmission of a board in 96 pixel cells, each holding some of a horizontal and a
+    // vertical trace, a via and a component.
+    KOKKOS_INLINE_FUNCTION float pcb_transmission(int x, int y) {
+      constexpr int cell = 96;
+      const int cx = x / cell;
+      const int cy = y / cell;
+      const int lx = x % cell;
+      const int ly = y % cell;
+      const uint32_t h = hash(static_cast<uint32_t>(cx) * 73856093u ^ static_cast<uint32_t>(cy) * 19349663u);
+
+      float t = 0.85f;
+      const int trace_width = 3 + (h >> 24) % 6;
+      if ((h & 1) && Kokkos::abs(ly - static_cast<int>((h >> 4) % cell)) < trace_width) t *= 0.55f;
+      if ((h & 2) && Kokkos::abs(lx - static_cast<int>((h >> 12) % cell)) < trace_width) t *= 0.55f;
+      if (h & 4) {
+        const int dx = lx - cell / 2;
+        const int dy = ly - cell / 2;
+        const int r2 = dx * dx + dy * dy;
+        if (r2 < 64) t *= r2 < 16 ? 0.9f : 0.2f;
+      }
+      if (h % 5 == 0 && lx > 12 && lx < 84 && ly > 24 && ly < 72) t *= 0.35f;
+      return t;
+    }
+
+    inline void fill_scene(ko::image::image_2d<float> scene) {
+      auto data = scene.data();
+      scene.parallel_for(KOKKOS_LAMBDA(const int x, const int y) {
+        data(x, y) = pcb_transmission(x, y);
+      });
+    }
+
+    using random_pool = Kokkos::Random_XorShift64_Pool<>;
+    using team_policy = Kokkos::TeamPolicy<>;
+    using team_member = typename team_policy::member_type;
+
+    // f(generator, x, y) for every pixel of a width x height image, a team per row. Each
+    // thread takes one generator from the pool for the whole row rather than one per pixel.
+    template<typename F>
+    void parallel_for_rows(const std::string& label, size_t width, size_t height, random_pool random, F f) {
+      Kokkos::parallel_for(label, team_policy(height, Kokkos::AUTO), KOKKOS_LAMBDA(const team_member& team) {
+        auto generator = random.get_state();
+        const size_t y = team.league_rank();
+        Kokkos::parallel_for(Kokkos::TeamThreadRange(team, width), [&](const size_t x) {
+          f(generator, x, y);
+        });
+        random.free_state(generator);
+      });
+    }
+
+    inline void fill_dark(ko::image::image_2d<float> dark, random_pool random, const synthetic_settings& settings) {
+      auto data = dark.data();
+      const double level = settings.dark_level;
+      const double spread = settings.dark_spread;
+      const double column_spread = settings.column_spread;
+      view<float*> columns("synthetic column offsets", dark.width());
+      parallel_for_rows("ko::synthetic::fill_dark::parallel_for drawing column offsets", dark.width(), 1, random,
+        KOKKOS_LAMBDA(random_pool::generator_type& generator, const size_t x, const size_t) {
+          columns(x) = generator.normal(0.0, column_spread);
+      });
+      parallel_for_rows("ko::synthetic::fill_dark::parallel_for drawing dark levels", dark.width(), dark.height(), random,
+        KOKKOS_LAMBDA(random_pool::generator_type& generator, const size_t x, const size_t y) {
+          data(x, y) = level + columns(x) + generator.normal(0.0, spread);
+      });
+    }
+
+    inline void fill_gain(ko::image::image_2d<float> gain, random_pool random, const synthetic_settings& settings) {
+      auto data = gain.data();
+      const double spread = settings.gain_spread;
+      const double vignetting = settings.vignetting;
+      const double cx = 0.5 * gain.width();
+      const double cy = 0.5 * gain.height();
+      const double r2_max = cx * cx + cy * cy;
+      parallel_for_rows("ko::synthetic::fill_gain::parallel_for drawing gains", gain.width(), gain.height(), random,
+        KOKKOS_LAMBDA(random_pool::generator_type& generator, const size_t x, const size_t y) {
+          const double r2 = ((x - cx) * (x - cx) + (y - cy) * (y - cy)) / r2_max;
+          data(x, y) = (1.0 - vignetting * r2) * generator.normal(1.0, spread);
+      });
+    }
+
+    inline void fill_defects(ko::image::image_2d<uint8_t> defects, random_pool random, const synthetic_settings& settings) {
+      auto data = defects.data();
+      const double fraction = settings.defect_fraction;
+      parallel_for_rows("ko::synthetic::fill_defects::parallel_for drawing defects", defects.width(), defects.height(), random,
+        KOKKOS_LAMBDA(random_pool::generator_type& generator, const size_t x, const size_t y) {
+          const double u = generator.drand();
+          data(x, y) = u < 0.5 * fraction ? dead_pixel : u < fraction ? hot_pixel : no_defect;
+      });
+    }
+  }
+
+  // Generates frames, and the calibration images a detector would be characterised with,
+  // for one synthetic detector.
+  template<typename T>
+  class frame_source {
+    synthetic_settings settings_;
+    synthetic_detail::random_pool random_;
+    ko::image::image_2d<float> dark_;
+    ko::image::image_2d<float> gain_;
+    ko::image::image_2d<float> scene_;
+    ko::image::image_2d<uint8_t> defects_;
+    size_t generated_ = 0;
+
+  public:
+    explicit frame_source(synthetic_settings settings = {})
+      : settings_(settings),
+        random_(settings.seed),
+        dark_(settings.width, settings.height),
+        gain_(settings.width, settings.height),
+        scene_(settings.width, settings.height),
+        defects_(settings.width, settings.height) {
+      synthetic_detail::fill_dark(dark_, random_, settings_);
+      synthetic_detail::fill_gain(gain_, random_, settings_);
+      synthetic_detail::fill_scene(scene_);
+      synthetic_detail::fill_defects(defects_, random_, settings_);
+    }
+
+    const synthetic_settings& settings() const { return settings_; }
+    size_t width() const { return settings_.width; }
+    size_t height() const { return settings_.height; }
+    size_t generated() const { return generated_; }
+
+    // Writes the next exposure of the scene into frame.
+    void next(ko::image::image_2d<T> frame) {
+      assert(frame.width() == width() && frame.height() == height());
+      auto dark = dark_.data();
+      auto gain = gain_.data();
+      auto scene = scene_.data();
+      auto defects = defects_.data();
+      const double flux = settings_.flux;
+      const double read_noise = settings_.read_noise;
+      const double max = settings_.max;
+      auto data = frame.data();
+      synthetic_detail::parallel_for_rows("ko::synthetic::frame_source::next::parallel_for drawing a frame", width(), height(), random_,
+        KOKKOS_LAMBDA(synthetic_detail::random_pool::generator_type& generator, const size_t x, const size_t y) {
+          double value;
+          if (defects(x, y) == dead_pixel) {
+            value = 0.0;
+          } else if (defects(x, y) == hot_pixel) {
+            value = max;
+          } else {
+            value = dark(x, y) + gain(x, y) * synthetic_detail::poisson(generator, flux * scene(x, y)) + generator.normal(0.0, read_noise);
+          }
+          data(x, y) = static_cast<T>(Kokkos::clamp(Kokkos::round(value), 0.0, max));
+      });
+      generated_ += 1;
+    }
+
+    // The noise free mean of many dark frames.
+    ko::image::image_2d<T> dark_frame() const {
+      ko::image::image_2d<T> frame(width(), height());
+      auto dark = dark_.data();
+      const double max = settings_.max;
+      frame.parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y, view<T**> data) {
+        data(x, y) = static_cast<T>(Kokkos::clamp(Kokkos::round(static_cast<double>(dark(x, y))), 0.0, max));
+      });
+      return frame;
+    }
+
+    // The noise free mean of many dark subtracted open beam frames.
+    ko::image::image_2d<T> gain_frame() const {
+      ko::image::image_2d<T> frame(width(), height());
+      auto gain = gain_.data();
+      const double flux = settings_.flux;
+      const double max = settings_.max;
+      frame.parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y, view<T**> data) {
+        data(x, y) = static_cast<T>(Kokkos::clamp(Kokkos::round(gain(x, y) * flux), 1.0, max));
+      });
+      return frame;
+    }
+
+    // 1 where a pixel is defective, 0 elsewhere.
+    ko::image::image_2d<T> defect_map() const {
+      ko::image::image_2d<T> map(width(), height());
+      auto defects = defects_.data();
+      map.parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y, view<T**> data) {
+        data(x, y) = defects(x, y) != no_defect ? 1 : 0;
+      });
+      return map;
+    }
+  };
+
+  struct pacing_report {
+    double fps = 0;
+    size_t frames = 0;
+    size_t processed = 0;
+    size_t dropped = 0;
+    double p50_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+  };
+
+  // Drives process(frame) from source at a fixed frame rate, like a detector with a single
+  // frame buffer: frame k arrives at k / fps and is lost if it hasn't been picked up by the
+  // time frame k + 1 arrives. Latency runs from arrival to the end of processing, including
+  // generating the frame, which stands in for readout. fps must be positive and finite.
+  template<typename T, typename Process>
+  pacing_report run_paced(frame_source<T>& source, ko::image::image_2d<T> frame, double fps, size_t frames, Process process) {
+    if (!(fps > 0.0) || !std::isfinite(fps)) throw std::invalid_argument("Frame rate must be positive");
+    using clock = std::chrono::steady_clock;
+    const auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / fps));
+    std::vector<double> latencies;
+    latencies.reserve(frames);
+
+    pacing_report report;
+    report.fps = fps;
+    report.frames = frames;
+    const auto start = clock::now();
+    for (size_t k = 0; k < frames; ++k) {
+      const auto arrival = start + k * period;
+      const auto now = clock::now();
+      if (now < arrival) {
+        std::this_thread::sleep_until(arrival);
+      } else if (now >= arrival + period) {
+        report.dropped += 1;
+        continue;
+      }
+      source.next(frame);
+      process(frame);
+      Kokkos::fence();
+      latencies.push_back(std::chrono::duration<double, std::milli>(clock::now() - arrival).count());
+    }
+
+    report.processed = latencies.size();
+    if (!latencies.empty()) {
+      std::sort(latencies.begin(), latencies.end());
+      auto percentile = [&](double p) { return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))]; };
+      report.p50_ms = percentile(0.50);
+      report.p99_ms = percentile(0.99);
+      report.max_ms = latencies.back();
+    }
+    return report;
+  }
+}
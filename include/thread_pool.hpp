@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace ko::concurrency {
+  // Fixed set of worker threads for host side work such as decoding and encoding frames.
+  class thread_pool {
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable available_;
+    bool stopping_ = false;
+
+    void work() {
+      for (;;) {
+        std::function<void()> task;
+        {
+          std::unique_lock lock(mutex_);
+          available_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+          if (stopping_ && tasks_.empty()) return;
+          task = std::move(tasks_.front());
+          tasks_.pop();
+        }
+        task();
+      }
+    }
+
+  public:
+    explicit thread_pool(size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+      workers_.reserve(threads);
+      for (size_t i = 0; i < threads; ++i) workers_.emplace_back([this] { work(); });
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    // Finishes the queued tasks, then joins.
+    ~thread_pool() {
+      {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+      }
+      available_.notify_all();
+      for (auto& worker : workers_) worker.join();
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    template<typename F>
+    auto submit(F f) -> std::future<std::invoke_result_t<F>> {
+      using result_type = std::invoke_result_t<F>;
+      auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(f));
+      auto result = task->get_future();
+      {
+        std::lock_guard lock(mutex_);
+        tasks_.emplace([task] { (*task)(); });
+      }
+      available_.notify_one();
+      return result;
+    }
+
+    // Runs f(i) for i in [0, n) across the pool and waits, rethrowing the first failure.
+    // Must not be called from one of the pool's own workers.
+    template<typename F>
+    void parallel_for(size_t n, F f) {
+      std::vector<std::future<void>> results;
+      results.reserve(n);
+      for (size_t i = 0; i < n; ++i) results.push_back(submit([&f, i] { f(i); }));
+      std::exception_ptr error;
+      for (auto& result : results) {
+        try {
+          result.get();
+        } catch (...) {
+          if (!error) error = std::current_exception();
+        }
+      }
+      if (error) std::rethrow_exception(error);
+    }
+  };
+}
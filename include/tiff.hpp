@@ -0,0 +1,432 @@
+#pragma once
+
+#include <mapped_file.hpp>
+#include <thread_pool.hpp>
+#include <zlib.h>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Baseline TIFF for single channel 8 and 16-bit unsigned images: strips or tiles,
+// uncompressed, deflate or packbits, with or without horizontal differencing. Chunks are
+// decoded and encoded in parallel on a thread_pool straight between the file and a row
+// pitched host buffer. Anything else is reported as tiff_unsupported so callers can fall
+// back to a general purpose decoder.
+namespace ko::io {
+  struct tiff_unsupported : std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  enum class tiff_compression : uint16_t {
+    none = 1,
+    deflate = 8,
+    packbits = 32773
+  };
+
+  struct tiff_write_options {
+    tiff_compression compression = tiff_compression::none;
+    bool predictor = false;     // horizontal differencing, helps deflate on smooth images
+    int deflate_level = 1;
+    size_t rows_per_strip = 0;  // 0 picks strips of about 64 KiB
+  };
+
+  // Layout of one page, as needed to decode it.
+  struct tiff_page {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t bits = 0;
+    tiff_compression compression = tiff_compression::none;
+    bool predictor = false;
+    bool tiled = false;
+    uint32_t chunk_width = 0;
+    uint32_t chunk_height = 0;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> byte_counts;
+
+    size_t chunks_across() const { return (width + chunk_width - 1) / chunk_width; }
+  };
+
+  namespace tiff_detail {
+    enum tag : uint16_t {
+      image_width = 256,
+      image_length = 257,
+      bits_per_sample = 258,
+      compression = 259,
+      photometric = 262,
+      strip_offsets = 273,
+      samples_per_pixel = 277,
+      rows_per_strip = 278,
+      strip_byte_counts = 279,
+      planar_configuration = 284,
+      predictor = 317,
+      tile_width = 322,
+      tile_length = 323,
+      tile_offsets = 324,
+      tile_byte_counts = 325,
+      sample_format = 339
+    };
+
+    enum field_type : uint16_t { type_byte = 1, type_short = 3, type_long = 4 };
+
+    inline uint16_t swap(uint16_t v) { return static_cast<uint16_t>(v << 8 | v >> 8); }
+    inline uint32_t swap(uint32_t v) { return (v << 24) | ((v << 8) & 0xff0000u) | ((v >> 8) & 0xff00u) | (v >> 24); }
+
+    template<typename T>
+    void undo_predictor(T* row, size_t n) {
+      for (size_t i = 1; i < n; ++i) row[i] = static_cast<T>(row[i] + row[i - 1]);
+    }
+
+    template<typename T>
+    void apply_predictor(T* row, size_t n) {
+      for (size_t i = n; i-- > 1;) row[i] = static_cast<T>(row[i] - row[i - 1]);
+    }
+
+    // Returns false if the input runs out or would overflow dst.
+    inline bool unpack_bits(const std::byte* src, size_t src_size, std::byte* dst, size_t dst_size) {
+      size_t in = 0, out = 0;
+      while (out < dst_size && in < src_size) {
+        const auto n = static_cast<int8_t>(src[in++]);
+        if (n >= 0) {
+          const size_t run = n + 1;
+          if (in + run > src_size || out + run > dst_size) return false;
+          std::memcpy(dst + out, src + in, run);
+          in += run;
+          out += run;
+        } else if (n != -128) {
+          const size_t run = 1 - n;
+          if (in >= src_size || out + run > dst_size) return false;
+          std::memset(dst + out, static_cast<int>(src[in++]), run);
+          out += run;
+        }
+      }
+      return out == dst_size;
+    }
+
+    // PackBits one row at a time, as the TIFF spec requires runs not to cross rows.
+    inline void pack_bits(const std::byte* src, size_t size, std::vector<std::byte>& dst) {
+      size_t i = 0;
+      while (i < size) {
+        size_t run = 1;
+        while (i + run < size && run < 128 && src[i + run] == src[i]) ++run;
+        if (run > 1) {
+          dst.push_back(static_cast<std::byte>(1 - static_cast<int>(run)));
+          dst.push_back(src[i]);
+          i += run;
+          continue;
+        }
+        size_t literal = 1;
+        while (i + literal < size && literal < 128 &&
+               !(i + literal + 1 < size && src[i + literal] == src[i + literal + 1])) {
+          ++literal;
+        }
+        dst.push_back(static_cast<std::byte>(literal - 1));
+        dst.insert(dst.end(), src + i, src + i + literal);
+        i += literal;
+      }
+    }
+  }
+
+  class tiff_reader {
+    mapped_file file_;
+    bool swapped_ = false;
+    std::vector<uint64_t> pages_;
+
+    void check(uint64_t offset, uint64_t length) const {
+      if (offset + length > file_.size() || offset + length < offset) throw std::runtime_error("Corrupt TIFF: offset out of range");
+    }
+
+    template<typename U>
+    U read(uint64_t offset) const {
+      check(offset, sizeof(U));
+      U value;
+      std::memcpy(&value, file_.data() + offset, sizeof(U));
+      return swapped_ ? tiff_detail::swap(value) : value;
+    }
+
+    std::vector<uint64_t> values(uint64_t entry) const {
+      const auto type = read<uint16_t>(entry + 2);
+      const auto count = read<uint32_t>(entry + 4);
+      const size_t size = type == tiff_detail::type_byte ? 1 : type == tiff_detail::type_short ? 2 : type == tiff_detail::type_long ? 4 : 0;
+      if (size == 0) throw tiff_unsupported("Unsupported TIFF field type");
+      const uint64_t base = size * count <= 4 ? entry + 8 : read<uint32_t>(entry + 8);
+      check(base, size * count);
+      std::vector<uint64_t> result(count);
+      for (uint32_t i = 0; i < count; ++i) {
+        const uint64_t at = base + i * size;
+        result[i] = size == 1 ? std::to_integer<uint64_t>(file_.data()[at]) : size == 2 ? read<uint16_t>(at) : read<uint32_t>(at);
+      }
+      return result;
+    }
+
+    template<typename T>
+    void decode_chunk(const tiff_page& page, size_t index, T* dst, size_t pitch, std::vector<std::byte>& buffer) const {
+      const size_t across = page.chunks_across();
+      const size_t x0 = (index % across) * page.chunk_width;
+      const size_t y0 = (index / across) * page.chunk_height;
+      const size_t cols = std::min<size_t>(page.chunk_width, page.width - x0);
+      const size_t rows = std::min<size_t>(page.chunk_height, page.height - y0);
+      // Strips hold only the rows they cover, tiles are always full size.
+      const size_t stored_rows = page.tiled ? page.chunk_height : rows;
+      const size_t expected = size_t(page.chunk_width) * stored_rows * sizeof(T);
+
+      const uint64_t offset = page.offsets[index];
+      const uint64_t length = page.byte_counts[index];
+      check(offset, length);
+      const std::byte* src = file_.data() + offset;
+
+      const std::byte* pixels = src;
+      if (page.compression == tiff_compression::none && !page.predictor && !(swapped_ && sizeof(T) > 1)) {
+        if (length < expected) throw std::runtime_error("Corrupt TIFF: short chunk");
+      } else {
+        buffer.resize(expected);
+        if (page.compression == tiff_compression::none) {
+          if (length < expected) throw std::runtime_error("Corrupt TIFF: short chunk");
+          std::memcpy(buffer.data(), src, expected);
+        } else if (page.compression == tiff_compression::deflate) {
+          uLongf size = expected;
+          const int status = uncompress(reinterpret_cast<Bytef*>(buffer.data()), &size, reinterpret_cast<const Bytef*>(src), length);
+          if ((status != Z_OK && status != Z_BUF_ERROR) || size != expected) throw std::runtime_error("Corrupt TIFF: bad deflate chunk");
+        } else if (!tiff_detail::unpack_bits(src, length, buffer.data(), expected)) {
+          throw std::runtime_error("Corrupt TIFF: bad packbits chunk");
+        }
+        T* samples = reinterpret_cast<T*>(buffer.data());
+        if constexpr (sizeof(T) > 1) {
+          if (swapped_) {
+            for (size_t i = 0; i < expected / sizeof(T); ++i) samples[i] = tiff_detail::swap(samples[i]);
+          }
+        }
+        if (page.predictor) {
+          for (size_t y = 0; y < stored_rows; ++y) tiff_detail::undo_predictor(samples + y * page.chunk_width, page.chunk_width);
+        }
+        pixels = buffer.data();
+      }
+
+      for (size_t y = 0; y < rows; ++y) {
+        std::memcpy(dst + (y0 + y) * pitch + x0, pixels + y * page.chunk_width * sizeof(T), cols * sizeof(T));
+      }
+    }
+
+  public:
+    explicit tiff_reader(const std::string& path)
+      : file_(path) {
+      if (file_.size() < 8) throw std::runtime_error("Not a TIFF file: " + path);
+      const char* magic = reinterpret_cast<const char*>(file_.data());
+      const bool little = magic[0] == 'I' && magic[1] == 'I';
+      if (!little && !(magic[0] == 'M' && magic[1] == 'M')) throw std::runtime_error("Not a TIFF file: " + path);
+      swapped_ = little != (std::endian::native == std::endian::little);
+      const auto version = read<uint16_t>(2);
+      if (version == 43) throw tiff_unsupported("BigTIFF isn't supported: " + path);
+      if (version != 42) throw std::runtime_error("Not a TIFF file: " + path);
+      for (uint64_t ifd = read<uint32_t>(4); ifd != 0; ifd = read<uint32_t>(ifd + 2 + 12 * uint64_t(read<uint16_t>(ifd)))) {
+        if (std::find(pages_.begin(), pages_.end(), ifd) != pages_.end()) throw std::runtime_error("Corrupt TIFF: IFD loop");
+        pages_.push_back(ifd);
+      }
+    }
+
+    size_t page_count() const { return pages_.size(); }
+
+    tiff_page page(size_t index = 0) const {
+      if (index >= pages_.size()) throw std::out_of_range("TIFF page index out of range");
+      const uint64_t ifd = pages_[index];
+      const auto entries = read<uint16_t>(ifd);
+
+      tiff_page page;
+      uint32_t rows_per_strip = UINT32_MAX;
+      for (uint16_t i = 0; i < entries; ++i) {
+        const uint64_t entry = ifd + 2 + 12 * uint64_t(i);
+        const auto tag = read<uint16_t>(entry);
+        switch (tag) {
+          case tiff_detail::image_width: page.width = values(entry).at(0); break;
+          case tiff_detail::image_length: page.height = values(entry).at(0); break;
+          case tiff_detail::bits_per_sample: page.bits = values(entry).at(0); break;
+          case tiff_detail::compression: {
+            const auto compression = values(entry).at(0);
+            if (compression == 32946) {
+              page.compression = tiff_compression::deflate;
+            } else if (compression == 1 || compression == 8 || compression == 32773) {
+              page.compression = static_cast<tiff_compression>(compression);
+            } else {
+              throw tiff_unsupported("Unsupported TIFF compression " + std::to_string(compression));
+            }
+            break;
+          }
+          case tiff_detail::photometric:
+            if (values(entry).at(0) != 1) throw tiff_unsupported("Only BlackIsZero TIFFs are supported");
+            break;
+          case tiff_detail::samples_per_pixel:
+            if (values(entry).at(0) != 1) throw tiff_unsupported("Only single channel TIFFs are supported");
+            break;
+          case tiff_detail::rows_per_strip: rows_per_strip = values(entry).at(0); break;
+          case tiff_detail::strip_offsets:
+          case tiff_detail::tile_offsets: page.offsets = values(entry); break;
+          case tiff_detail::strip_byte_counts:
+          case tiff_detail::tile_byte_counts: page.byte_counts = values(entry); break;
+          case tiff_detail::predictor: {
+            const auto predictor = values(entry).at(0);
+            if (predictor > 2) throw tiff_unsupported("Unsupported TIFF predictor");
+            page.predictor = predictor == 2;
+            break;
+          }
+          case tiff_detail::tile_width: page.tiled = true; page.chunk_width = values(entry).at(0); break;
+          case tiff_detail::tile_length: page.tiled = true; page.chunk_height = values(entry).at(0); break;
+          case tiff_detail::sample_format:
+            if (values(entry).at(0) != 1) throw tiff_unsupported("Only unsigned integer TIFFs are supported");
+            break;
+          default: break;
+        }
+      }
+
+      if (page.bits != 8 && page.bits != 16) throw tiff_unsupported("Only 8 and 16-bit TIFFs are supported");
+      if (page.width == 0 || page.height == 0) throw std::runtime_error("Corrupt TIFF: empty image");
+      if (!page.tiled) {
+        page.chunk_width = page.width;
+        page.chunk_height = std::min(rows_per_strip, page.height);
+      }
+      if (page.chunk_width == 0 || page.chunk_height == 0) throw std::runtime_error("Corrupt TIFF: empty chunk");
+      const size_t chunks = page.chunks_across() * ((page.height + page.chunk_height - 1) / page.chunk_height);
+      if (page.offsets.size() != chunks || page.byte_counts.size() != chunks) throw std::runtime_error("Corrupt TIFF: chunk count mismatch");
+      return page;
+    }
+
+    // Decodes page into dst, pitch elements between rows, one chunk range per task.
+    template<typename T>
+    void read(const tiff_page& page, T* dst, size_t pitch, ko::concurrency::thread_pool& pool) const {
+      static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>);
+      if (page.bits != 8 * sizeof(T)) throw std::runtime_error("TIFF bit depth doesn't match element type");
+      const size_t chunks = page.offsets.size();
+      const size_t tasks = std::min(chunks, 4 * pool.size());
+      pool.parallel_for(tasks, [&](size_t task) {
+        std::vector<std::byte> buffer;
+        for (size_t i = task * chunks / tasks; i < (task + 1) * chunks / tasks; ++i) decode_chunk(page, i, dst, pitch, buffer);
+      });
+    }
+
+    // The same on the calling thread, for callers already decoding one page per task.
+    template<typename T>
+    void read(const tiff_page& page, T* dst, size_t pitch) const {
+      static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>);
+      if (page.bits != 8 * sizeof(T)) throw std::runtime_error("TIFF bit depth doesn't match element type");
+      std::vector<std::byte> buffer;
+      for (size_t i = 0; i < page.offsets.size(); ++i) decode_chunk(page, i, dst, pitch, buffer);
+    }
+  };
+
+  // Writes one page of strips, encoded in parallel, then written in order. Samples are
+  // stored in native byte order.
+  template<typename T>
+  void write_tiff(const std::string& path, const T* src, size_t width, size_t height, size_t pitch,
+                  ko::concurrency::thread_pool& pool, tiff_write_options options = {}) {
+    static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>);
+    const size_t row_bytes = width * sizeof(T);
+    const size_t rows_per_strip = std::min(height, options.rows_per_strip ? options.rows_per_strip : std::max<size_t>(1, (64 << 10) / row_bytes));
+    const size_t strips = (height + rows_per_strip - 1) / rows_per_strip;
+    const bool predictor = options.predictor && options.compression != tiff_compression::none;
+
+    std::vector<std::vector<std::byte>> encoded(strips);
+    pool.parallel_for(strips, [&](size_t strip) {
+      const size_t y0 = strip * rows_per_strip;
+      const size_t rows = std::min(rows_per_strip, height - y0);
+      std::vector<std::byte> raw(rows * row_bytes);
+      for (size_t y = 0; y < rows; ++y) {
+        std::memcpy(raw.data() + y * row_bytes, src + (y0 + y) * pitch, row_bytes);
+        if (predictor) tiff_detail::apply_predictor(reinterpret_cast<T*>(raw.data() + y * row_bytes), width);
+      }
+      auto& out = encoded[strip];
+      if (options.compression == tiff_compression::deflate) {
+        uLongf size = compressBound(raw.size());
+        out.resize(size);
+        if (compress2(reinterpret_cast<Bytef*>(out.data()), &size, reinterpret_cast<const Bytef*>(raw.data()), raw.size(), options.deflate_level) != Z_OK) {
+          throw std::runtime_error("Failed to deflate TIFF strip");
+        }
+        out.resize(size);
+      } else if (options.compression == tiff_compression::packbits) {
+        out.reserve(raw.size() + raw.size() / 128 + rows);
+        for (size_t y = 0; y < rows; ++y) tiff_detail::pack_bits(raw.data() + y * row_bytes, row_bytes, out);
+      } else {
+        out = std::move(raw);
+      }
+    });
+
+    std::vector<uint32_t> offsets(strips), byte_counts(strips);
+    uint64_t position = 8;
+    for (size_t i = 0; i < strips; ++i) {
+      offsets[i] = static_cast<uint32_t>(position);
+      byte_counts[i] = static_cast<uint32_t>(encoded[i].size());
+      position += encoded[i].size();
+    }
+    const uint64_t data_end = position;
+    position += position & 1;
+    if (position + 12 * 16 + 8 * strips > UINT32_MAX) throw std::runtime_error("Image too large for TIFF: " + path);
+
+    struct entry { uint16_t tag, type; uint32_t count, value; };
+    std::vector<entry> entries;
+    std::vector<std::byte> extra;
+    const uint64_t ifd = position;
+    auto add_array = [&](uint16_t tag, const std::vector<uint32_t>& array) {
+      if (array.size() == 1) {
+        entries.push_back({tag, tiff_detail::type_long, 1, array[0]});
+        return;
+      }
+      entries.push_back({tag, tiff_detail::type_long, static_cast<uint32_t>(array.size()), 0});
+      extra.resize(extra.size() + array.size() * 4);
+      std::memcpy(extra.data() + extra.size() - array.size() * 4, array.data(), array.size() * 4);
+    };
+    auto add_short = [&](uint16_t tag, uint16_t value) {
+      // A SHORT sits in the first two bytes of the value field.
+      uint32_t field = 0;
+      std::memcpy(&field, &value, 2);
+      entries.push_back({tag, tiff_detail::type_short, 1, field});
+    };
+    entries.push_back({tiff_detail::image_width, tiff_detail::type_long, 1, static_cast<uint32_t>(width)});
+    entries.push_back({tiff_detail::image_length, tiff_detail::type_long, 1, static_cast<uint32_t>(height)});
+    add_short(tiff_detail::bits_per_sample, 8 * sizeof(T));
+    add_short(tiff_detail::compression, static_cast<uint16_t>(options.compression));
+    add_short(tiff_detail::photometric, 1);
+    add_array(tiff_detail::strip_offsets, offsets);
+    add_short(tiff_detail::samples_per_pixel, 1);
+    entries.push_back({tiff_detail::rows_per_strip, tiff_detail::type_long, 1, static_cast<uint32_t>(rows_per_strip)});
+    add_array(tiff_detail::strip_byte_counts, byte_counts);
+    add_short(tiff_detail::planar_configuration, 1);
+    if (predictor) add_short(tiff_detail::predictor, 2);
+    add_short(tiff_detail::sample_format, 1);
+
+    // Arrays follow the IFD, in the order their entries were added.
+    uint32_t array_offset = static_cast<uint32_t>(ifd + 2 + 12 * entries.size() + 4);
+    for (auto& e : entries) {
+      if (e.type == tiff_detail::type_long && e.count > 1) {
+        e.value = array_offset;
+        array_offset += 4 * e.count;
+      }
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) throw std::runtime_error("Failed to open: " + path);
+    const char byte_order = std::endian::native == std::endian::little ? 'I' : 'M';
+    const char header[4] = {byte_order, byte_order, 0, 0};
+    const uint16_t version = 42;
+    const uint32_t first_ifd = static_cast<uint32_t>(ifd);
+    file.write(header, 2);
+    file.write(reinterpret_cast<const char*>(&version), 2);
+    file.write(reinterpret_cast<const char*>(&first_ifd), 4);
+    for (const auto& strip : encoded) file.write(reinterpret_cast<const char*>(strip.data()), strip.size());
+    if (data_end & 1) file.put(0);
+    const uint16_t count = static_cast<uint16_t>(entries.size());
+    const uint32_t next_ifd = 0;
+    file.write(reinterpret_cast<const char*>(&count), 2);
+    for (const auto& e : entries) {
+      file.write(reinterpret_cast<const char*>(&e.tag), 2);
+      file.write(reinterpret_cast<const char*>(&e.type), 2);
+      file.write(reinterpret_cast<const char*>(&e.count), 4);
+      file.write(reinterpret_cast<const char*>(&e.value), 4);
+    }
+    file.write(reinterpret_cast<const char*>(&next_ifd), 4);
+    file.write(reinterpret_cast<const char*>(extra.data()), extra.size());
+    if (!file) throw std::runtime_error("Failed to write: " + path);
+  }
+}
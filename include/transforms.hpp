@@ -1,212 +1,745 @@
-#pragma once
-
-#include <concepts.hpp>
-#include <kokkos_types.hpp>
-#include <image.hpp>
-#include <maths.hpp>
-#include <statistics.hpp>
-
-namespace ko::transforms {
-  template<typename T>
-  void dark_correction(
-    ko::image::image_2d<T> input,
-    ko::image::image_2d<T> dark,
-    T offset,
-    T min,
-    T max
-  ) {
-    auto input_data = input.data();
-    auto dark_data = dark.data();
-
-    input -= dark;
-    input += offset;
-    ko::maths::clamp(input, min, max);
-  }
-
-  template<typename T>
-  void gain_correction(
-    ko::image::image_2d<T> input,
-    ko::image::image_2d<double> normed_gain,
-    T min,
-    T max
-  ) {
-    auto normed_gain_data = normed_gain.data();
-    input.parallel_for(KOKKOS_LAMBDA(size_t x, size_t y, view<T**> data, size_t width, size_t height) -> void {
-      T val = data(x, y) * normed_gain_data(x, y);
-      data(x, y) = Kokkos::clamp(val, min, max);
-    });
-  }
-
-template<typename T>
-void defect_correction(
-    ko::image::image_2d<T> input, 
-    ko::image::image_2d<T> defect_map,
-    Kokkos::View<double**> kernel) {
-    int kernel_half_size = kernel.extent(0) / 2;
-    auto defect_data = defect_map.data();
-
-    input.parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y, view<T**> data, const size_t width, const size_t height) -> void {
-      if (defect_data(x, y) == 1) {
-        double sum = 0.0;
-        double weight_sum = 0.0;
-
-        for (int kx = -kernel_half_size; kx <= kernel_half_size; ++kx) {
-            for (int ky = -kernel_half_size; ky <= kernel_half_size; ++ky) {
-                size_t nx = x + kx;
-                size_t ny = y + ky;
-
-                if (nx >= 0 && nx < width && ny >= 0 && ny < height && !defect_data(nx, ny)) {
-                    sum += data(nx, ny) * kernel(kx + kernel_half_size, ky + kernel_half_size);
-                    weight_sum += kernel(kx + kernel_half_size, ky + kernel_half_size);
-                }
-            }
-        }
-
-        if (weight_sum > 0.0) {
-            data(x, y) = sum / weight_sum;
-        }
-      }
-    });
-}
-
-  template<typename T>
-  void normalise(ko::image::image_2d<double> norm, const ko::image::image_2d<T> input) {
-    Kokkos::MDRangePolicy<Kokkos::Rank<2>> policy({0, 0}, {input.width(), input.height()});
-
-    double mean = ko::statistics::mean(input);
-    auto input_data = input.data();
-    auto norm_data = norm.data();
-
-    Kokkos::parallel_for("normalising", policy, KOKKOS_LAMBDA(const int x, const int y) {
-      T val = input_data(x, y);
-      norm_data(x, y) = val == 0 ? 1 : mean / val;
-    });
-  }
-
-  template<typename T>
-  void histogram_equalisation(
-    ko::image::image_2d<T> image,
-    view<int*> histogram, 
-    view<double*> normed_histogram_working_buffer,
-    view<T*> lut_working_buffer,
-    T histo_eq_range) {
-    const size_t histogram_size = histogram.size();
-    const size_t image_size = image.element_count();
-    auto image_data = image.data();
-
-    Kokkos::MDRangePolicy<Kokkos::Rank<2>> policy({0, 0}, {image.width(), image.height()});
-
-    Kokkos::parallel_scan(
-      "ko::transforms::histogram_equalisation::parallal_scan calculating cumulative histogram", 
-      histogram_size, 
-      KOKKOS_LAMBDA(const int i, size_t& update, const bool final) {
-        update += histogram(i);
-        if (final) histogram(i) = update;
-    });
-
-    Kokkos::parallel_for(
-      "ko::transforms::histogram_equalisation::parallel_for normalising histogram",
-      histogram_size,
-      KOKKOS_LAMBDA(const int i) {
-        normed_histogram_working_buffer(i) = static_cast<float>(histogram(i)) / image_size;
-    });
-
-    Kokkos::parallel_for(
-      "ko::transforms::histogram_equalisation::parallel_for building lut",
-      histogram_size,
-      KOKKOS_LAMBDA(const int i) {
-        lut_working_buffer(i) = static_cast<T>(normed_histogram_working_buffer(i) * histo_eq_range);
-    });
-
-    Kokkos::parallel_for(
-      "ko::transforms::histogram_equalisation::parallel_for equalising image using lut",
-      policy,
-      KOKKOS_LAMBDA(const int x, const int y) {
-        image_data(x, y) = lut_working_buffer(image_data(x, y));
-    });
-  }
-
-  template<typename A, typename B, typename C>
-  KOKKOS_INLINE_FUNCTION 
-  C dot_product(view<A**> view1, view<B**> view2) {
-    const size_t width = view1.extent(0);
-    const size_t height = view1.extent(1);
-
-    C sum = 0;
-
-    Kokkos::parallel_reduce("dot_product", Kokkos::MDRangePolicy<Kokkos::Rank<2>>({0, 0}, {width, height}),
-    KOKKOS_LAMBDA(const int x, const int y, C& local_sum) {
-        local_sum += (static_cast<C>(view1(x, y)) * static_cast<C>(view2(x, y)));
-    }, sum);
-
-    return sum;
-  }
-
-  template<typename T>
-  void mean_filter(ko::image::image_2d<T> input, ko::image::image_2d<float> mean_filtered_image, size_t window_size) {
-    auto mean_data = mean_filtered_image.data();
-    auto input_data = input.data();
-
-    constexpr size_t team_size = 1024;
-    const size_t league_size = input_data.size() / team_size;
-
-    Kokkos::TeamPolicy<> team_policy(league_size, team_size);
-
-    int window_half_size = window_size / 2;
-
-    input.parallel_for(KOKKOS_LAMBDA(const int x, const int y, view<T**> input_data) {
-        float sum = 0.0;
-        int count = 0;
-        for (int win_x = 0; win_x < window_size; ++win_x)
-          for (int win_y = 0; win_y < window_size; ++win_y) {
-            int nx = x - window_half_size + win_x;
-            int ny = y - window_half_size + win_y;
-            if (nx >= 0 && nx < input_data.extent(0) && ny >= 0 && ny < input_data.extent(1)) {
-              sum += input_data(nx, ny);
-              count++;
-            } 
-          }
-        mean_data(x, y) = sum / count;
-    });
-  }
-
-  template<typename T>
-  struct mean_filter_shared_mem {
-    using shared_thread_space = view<T**, Kokkos::MemoryTraits<Kokkos::Unmanaged>>;
-    using team_member = typename Kokkos::TeamPolicy<>::member_type;
-
-    view<T**> input_;
-    view<float**> result_;
-    size_t window_size_;
-
-    mean_filter_shared_mem(view<T**> input, view<float**> result, size_t window_size) : 
-    input_(input), result_(result), window_size_(window_size) {}
-
-    void run(view<T**> input, view<float**> result) {
-      const size_t league_size = input_.size() / 32;
-      const size_t team_size = 32;
-      size_t shared_thread_mem_size = window_size_ * window_size_ * input_.size() * sizeof(T);
-      Kokkos::parallel_for(Kokkos::TeamPolicy<>(league_size, team_size, 16), KOKKOS_LAMBDA(const team_member& team) {
-        Kokkos::parallel_for(Kokkos::TeamThreadRange(team, team_size), [&](const int i) {
-          size_t k = team.league_rank() * league_size * i;
-          
-          size_t x = k % input.extent(0);
-          size_t y = k / input.extent(0);
-
-          float sum = 0;
-          Kokkos::parallel_reduce(Kokkos::ThreadVectorRange(team, window_size_ * window_size_), [&](int j, float& local_sum) {
-            local_sum += 1.0f;
-          }, sum);
-
-          Kokkos::single(Kokkos::PerThread(team), [=]() { printf("%f\n", sum); });
-
-          printf("%d %d %d %d %f\n", i, k, x, y, sum);
-
-          // Kokkos::single(Kokkos::PerThread(team), [=]() {
-          //   printf("%d %d %d %d\n", i, k, x, y);
-          // });
-        });
-      });
-    }
-  };
+#pragma once
+
+#include <concepts.hpp>
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <maths.hpp>
+#include <statistics.hpp>
+#include <stencil.hpp>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace ko::transforms {
+  // The per-pixel correction formulas, shared by the image, stack and packed overloads
+  // so clamping and rounding are defined once. Arithmetic is in V, normally
+  // ko::maths::compute_type_t of the element types, and the dark is subtracted before
+  // the clamp so it can't wrap.
+  template<typename T, typename V>
+  struct pixel_correction {
+    V offset;
+    V lo;
+    V hi;
+
+    pixel_correction(T offset, T min, T max)
+      : offset(static_cast<V>(offset)), lo(static_cast<V>(min)), hi(static_cast<V>(max)) {}
+
+    template<typename R, typename D>
+    KOKKOS_INLINE_FUNCTION
+    V dark_subtracted(R raw, D dark) const {
+      return Kokkos::clamp(static_cast<V>(raw) - static_cast<V>(dark) + offset, lo, hi);
+    }
+
+    template<typename R, typename D>
+    KOKKOS_INLINE_FUNCTION
+    T dark_corrected(R raw, D dark) const { return static_cast<T>(dark_subtracted(raw, dark)); }
+
+    template<typename R, typename G>
+    KOKKOS_INLINE_FUNCTION
+    T gain_corrected(R raw, G normed_gain) const {
+      return static_cast<T>(Kokkos::clamp(static_cast<V>(raw) * static_cast<V>(normed_gain), lo, hi));
+    }
+
+    template<typename R, typename D, typename G>
+    KOKKOS_INLINE_FUNCTION
+    T flat_field_corrected(R raw, D dark, G normed_gain) const { return gain_corrected(dark_subtracted(raw, dark), normed_gain); }
+  };
+
+  template<typename T>
+  void dark_correction(
+    ko::image::image_2d<T> input,
+    ko::image::image_2d<T> dark,
+    T offset,
+    T min,
+    T max
+  ) {
+    const pixel_correction<T, ko::maths::compute_type_t<T>> correction(offset, min, max);
+    auto dark_data = dark.data();
+
+    input.parallel_for(KOKKOS_LAMBDA(size_t x, size_t y, view<T**> data) -> void {
+      data(x, y) = correction.dark_corrected(data(x, y), dark_data(x, y));
+    });
+  }
+
+  template<typename T, typename G>
+  void gain_correction(
+    ko::image::image_2d<T> input,
+    ko::image::image_2d<G> normed_gain,
+    T min,
+    T max
+  ) {
+    const pixel_correction<T, ko::maths::compute_type_t<T, G>> correction(T(0), min, max);
+    auto normed_gain_data = normed_gain.data();
+    input.parallel_for(KOKKOS_LAMBDA(size_t x, size_t y, view<T**> data) -> void {
+      data(x, y) = correction.gain_corrected(data(x, y), normed_gain_data(x, y));
+    });
+  }
+
+  // Single pass equivalent of dark_correction followed by gain_correction. Each pixel,
+  // its dark and its gain are read once and the result is written once; intermediates
+  // stay in registers so the subtraction can't wrap before the clamp. Runs on space,
+  // so a pipeline can keep it off the instances moving frames.
+  template<typename T, typename D, typename G>
+  void flat_field_correction(
+    ko::image::image_2d<T> input,
+    ko::image::image_2d<D> dark,
+    ko::image::image_2d<G> normed_gain,
+    T offset,
+    T min,
+    T max,
+    const Kokkos::DefaultExecutionSpace& space = {}
+  ) {
+    assert(input.width() == dark.width() && input.height() == dark.height());
+    assert(input.width() == normed_gain.width() && input.height() == normed_gain.height());
+
+    const pixel_correction<T, ko::maths::compute_type_t<T, D, G>> correction(offset, min, max);
+    auto data = input.data();
+    auto dark_data = dark.data();
+    auto normed_gain_data = normed_gain.data();
+
+    Kokkos::parallel_for("ko::transforms::flat_field_correction::parallel_for correcting pixels",
+      image_policy(space, {0, 0}, {input.width(), input.height()}),
+      KOKKOS_LAMBDA(const size_t x, const size_t y) {
+        data(x, y) = correction.flat_field_corrected(data(x, y), dark_data(x, y), normed_gain_data(x, y));
+    });
+  }
+
+  // Stack forms of the corrections above, one launch for every frame of input.
+  template<typename T>
+  void dark_correction(
+    ko::image::image_3d<T> input,
+    ko::image::image_2d<T> dark,
+    T offset,
+    T min,
+    T max
+  ) {
+    assert(input.width() == dark.width() && input.height() == dark.height());
+
+    const pixel_correction<T, ko::maths::compute_type_t<T>> correction(offset, min, max);
+    auto data = input.data();
+    auto dark_data = dark.data();
+
+    input.parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y, const size_t k) {
+      data(x, y, k) = correction.dark_corrected(data(x, y, k), dark_data(x, y));
+    });
+  }
+
+  template<typename T, typename G>
+  void gain_correction(
+    ko::image::image_3d<T> input,
+    ko::image::image_2d<G> normed_gain,
+    T min,
+    T max
+  ) {
+    assert(input.width() == normed_gain.width() && input.height() == normed_gain.height());
+
+    const pixel_correction<T, ko::maths::compute_type_t<T, G>> correction(T(0), min, max);
+    auto data = input.data();
+    auto normed_gain_data = normed_gain.data();
+
+    input.parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y, const size_t k) {
+      data(x, y, k) = correction.gain_corrected(data(x, y, k), normed_gain_data(x, y));
+    });
+  }
+
+  template<typename T, typename D, typename G>
+  void flat_field_correction(
+    ko::image::image_3d<T> input,
+    ko::image::image_2d<D> dark,
+    ko::image::image_2d<G> normed_gain,
+    T offset,
+    T min,
+    T max
+  ) {
+    assert(input.width() == dark.width() && input.height() == dark.height());
+    assert(input.width() == normed_gain.width() && input.height() == normed_gain.height());
+
+    const pixel_correction<T, ko::maths::compute_type_t<T, D, G>> correction(offset, min, max);
+    auto data = input.data();
+    auto dark_data = dark.data();
+    auto normed_gain_data = normed_gain.data();
+
+    input.parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y, const size_t k) {
+      data(x, y, k) = correction.flat_field_corrected(data(x, y, k), dark_data(x, y), normed_gain_data(x, y));
+    });
+  }
+
+template<typename T>
+void defect_correction(
+    ko::image::image_2d<T> input, 
+    ko::image::image_2d<T> defect_map,
+    view<double**> kernel) {
+    int kernel_half_size = kernel.extent(0) / 2;
+    auto defect_data = defect_map.data();
+
+    input.parallel_for(KOKKOS_LAMBDA(const size_t x, const size_t y, view<T**> data, const size_t width, const size_t height) -> void {
+      if (defect_data(x, y) == 1) {
+        double sum = 0.0;
+        double weight_sum = 0.0;
+
+        for (int kx = -kernel_half_size; kx <= kernel_half_size; ++kx) {
+            for (int ky = -kernel_half_size; ky <= kernel_half_size; ++ky) {
+                size_t nx = x + kx;
+                size_t ny = y + ky;
+
+                if (nx >= 0 && nx < width && ny >= 0 && ny < height && !defect_data(nx, ny)) {
+                    sum += data(nx, ny) * kernel(kx + kernel_half_size, ky + kernel_half_size);
+                    weight_sum += kernel(kx + kernel_half_size, ky + kernel_half_size);
+                }
+            }
+        }
+
+        if (weight_sum > 0.0) {
+            data(x, y) = sum / weight_sum;
+        }
+      }
+    });
+}
+
+  // size x size gaussian with the given sigma, centred on the middle element.
+  inline view<double**> gaussian_kernel(size_t size, double sigma) {
+    view<double**> kernel("gaussian kernel", size, size);
+    const int half_size = size / 2;
+    Kokkos::parallel_for("ko::transforms::gaussian_kernel parallel for", image_policy({0, 0}, {size, size}),
+      KOKKOS_LAMBDA(const int i, const int j) {
+        const int x = i - half_size;
+        const int y = j - half_size;
+        kernel(i, j) = Kokkos::exp(-(x * x + y * y) / (2 * sigma * sigma)) / (2 * Kokkos::numbers::pi * sigma * sigma);
+    });
+    return kernel;
+  }
+
+  // Calibration-time form of a defect map: the defective pixels (those set to 1, as in
+  // defect_correction above) and, CSR style, the usable neighbours of each with kernel
+  // weights already normalised. Indices are linear, x + y * width.
+  struct defect_plan {
+    view<uint32_t*> pixels;
+    view<uint32_t*> offsets;
+    view<uint32_t*> neighbours;
+    view<float*> weights;
+    size_t width = 0;
+    size_t height = 0;
+
+    size_t defect_count() const { return pixels.extent(0); }
+
+    // The plan indexes pixels by linear position, so an image of another shape would be
+    // read and written out of bounds.
+    void check_shape(size_t image_width, size_t image_height) const {
+      if (image_width != width || image_height != height) throw std::invalid_argument("Defect plan doesn't match the image size");
+    }
+  };
+
+  template<typename T>
+  defect_plan make_defect_plan(ko::image::image_2d<T> defect_map, view<double**> kernel) {
+    const int width = defect_map.width();
+    const int height = defect_map.height();
+    const int kernel_half_size = kernel.extent(0) / 2;
+    auto defect_data = defect_map.data();
+
+    defect_plan plan;
+    plan.width = width;
+    plan.height = height;
+
+    uint32_t defect_count = 0;
+    Kokkos::parallel_reduce(
+      "ko::transforms::make_defect_plan::parallel_reduce counting defects",
+      static_cast<size_t>(width) * height,
+      KOKKOS_LAMBDA(const size_t i, uint32_t& local_count) {
+        if (defect_data(i % width, i / width) == 1) local_count += 1;
+    }, Kokkos::Sum<uint32_t>(defect_count));
+
+    auto pixels = view<uint32_t*>("defect_plan pixels", defect_count);
+    auto offsets = view<uint32_t*>("defect_plan offsets", defect_count + 1);
+
+    Kokkos::parallel_scan(
+      "ko::transforms::make_defect_plan::parallel_scan compacting defects",
+      static_cast<size_t>(width) * height,
+      KOKKOS_LAMBDA(const size_t i, uint32_t& update, const bool final) {
+        if (defect_data(i % width, i / width) == 1) {
+          if (final) pixels(update) = i;
+          update += 1;
+        }
+    });
+
+    Kokkos::parallel_for(
+      "ko::transforms::make_defect_plan::parallel_for counting neighbours",
+      defect_count,
+      KOKKOS_LAMBDA(const size_t i) {
+        const int x = pixels(i) % width;
+        const int y = pixels(i) / width;
+        uint32_t count = 0;
+        for (int kx = -kernel_half_size; kx <= kernel_half_size; ++kx)
+          for (int ky = -kernel_half_size; ky <= kernel_half_size; ++ky) {
+            const int nx = x + kx;
+            const int ny = y + ky;
+            if (nx >= 0 && nx < width && ny >= 0 && ny < height && defect_data(nx, ny) == 0 &&
+                kernel(kx + kernel_half_size, ky + kernel_half_size) > 0.0)
+              count += 1;
+          }
+        offsets(i) = count;
+    });
+
+    uint32_t neighbour_count = 0;
+    Kokkos::parallel_scan(
+      "ko::transforms::make_defect_plan::parallel_scan neighbour offsets",
+      defect_count + 1,
+      KOKKOS_LAMBDA(const size_t i, uint32_t& update, const bool final) {
+        const uint32_t count = offsets(i);
+        if (final) offsets(i) = update;
+        update += count;
+    }, neighbour_count);
+
+    auto neighbours = view<uint32_t*>("defect_plan neighbours", neighbour_count);
+    auto weights = view<float*>("defect_plan weights", neighbour_count);
+
+    Kokkos::parallel_for(
+      "ko::transforms::make_defect_plan::parallel_for weighting neighbours",
+      defect_count,
+      KOKKOS_LAMBDA(const size_t i) {
+        const int x = pixels(i) % width;
+        const int y = pixels(i) / width;
+        const uint32_t begin = offsets(i);
+        uint32_t k = begin;
+        double weight_sum = 0.0;
+        for (int kx = -kernel_half_size; kx <= kernel_half_size; ++kx)
+          for (int ky = -kernel_half_size; ky <= kernel_half_size; ++ky) {
+            const int nx = x + kx;
+            const int ny = y + ky;
+            const double weight = kernel(kx + kernel_half_size, ky + kernel_half_size);
+            if (nx >= 0 && nx < width && ny >= 0 && ny < height && defect_data(nx, ny) == 0 && weight > 0.0) {
+              neighbours(k) = nx + ny * width;
+              weights(k) = weight;
+              weight_sum += weight;
+              ++k;
+            }
+          }
+        for (uint32_t j = begin; j < k; ++j)
+          weights(j) = weights(j) / weight_sum;
+    });
+
+    plan.pixels = pixels;
+    plan.offsets = offsets;
+    plan.neighbours = neighbours;
+    plan.weights = weights;
+    return plan;
+  }
+
+  template<typename T>
+  void defect_correction(ko::image::image_2d<T> input, const defect_plan& plan, const Kokkos::DefaultExecutionSpace& space = {}) {
+    plan.check_shape(input.width(), input.height());
+    auto data = input.data();
+    auto pixels = plan.pixels;
+    auto offsets = plan.offsets;
+    auto neighbours = plan.neighbours;
+    auto weights = plan.weights;
+    const size_t width = plan.width;
+
+    Kokkos::parallel_for(
+      "ko::transforms::defect_correction::parallel_for gathering neighbours",
+      Kokkos::RangePolicy<>(space, 0, plan.defect_count()),
+      KOKKOS_LAMBDA(const size_t i) {
+        const uint32_t begin = offsets(i);
+        const uint32_t end = offsets(i + 1);
+        if (begin == end) return;
+
+        float sum = 0.0f;
+        for (uint32_t k = begin; k < end; ++k) {
+          const uint32_t n = neighbours(k);
+          sum += weights(k) * static_cast<float>(data(n % width, n / width));
+        }
+        data(pixels(i) % width, pixels(i) / width) = static_cast<T>(sum);
+    });
+  }
+
+  // defect_correction of every frame of input in one launch, a thread per defect and frame.
+  template<typename T>
+  void defect_correction(ko::image::image_3d<T> input, const defect_plan& plan) {
+    plan.check_shape(input.width(), input.height());
+    auto data = input.data();
+    auto pixels = plan.pixels;
+    auto offsets = plan.offsets;
+    auto neighbours = plan.neighbours;
+    auto weights = plan.weights;
+    const size_t width = plan.width;
+
+    Kokkos::parallel_for(
+      "ko::transforms::defect_correction::parallel_for gathering neighbours across stack",
+      image_policy({0, 0}, {plan.defect_count(), input.depth()}),
+      KOKKOS_LAMBDA(const size_t i, const size_t k) {
+        const uint32_t begin = offsets(i);
+        const uint32_t end = offsets(i + 1);
+        if (begin == end) return;
+
+        float sum = 0.0f;
+        for (uint32_t j = begin; j < end; ++j) {
+          const uint32_t n = neighbours(j);
+          sum += weights(j) * static_cast<float>(data(n % width, n / width, k));
+        }
+        data(pixels(i) % width, pixels(i) / width, k) = static_cast<T>(sum);
+    });
+  }
+
+  // Writes mean / pixel for each pixel of a gain image. The element type of norm picks
+  // the encoding: double, float, or a ko::maths::fixed_point such as q2_14.
+  template<typename G, typename T>
+  void normalise(ko::image::image_2d<G> norm, const ko::image::image_2d<T> input) {
+    image_policy policy({0, 0}, {input.width(), input.height()});
+
+    double mean = ko::statistics::mean(input);
+    auto input_data = input.data();
+    auto norm_data = norm.data();
+
+    Kokkos::parallel_for("normalising", policy, KOKKOS_LAMBDA(const int x, const int y) {
+      T val = input_data(x, y);
+      norm_data(x, y) = static_cast<G>(val == 0 ? 1.0 : mean / val);
+    });
+  }
+
+  // Validation for compact gain encodings: the largest absolute difference, in output
+  // counts, between gain_correction of input with reference_gain and with gain.
+  template<typename T, typename G>
+  double gain_encoding_error(
+    const ko::image::image_2d<T> input,
+    ko::image::image_2d<double> reference_gain,
+    ko::image::image_2d<G> gain,
+    T min,
+    T max
+  ) {
+    const pixel_correction<T, ko::maths::compute_type_t<T, G>> correction(T(0), min, max);
+    auto input_data = input.data();
+    auto reference_data = reference_gain.data();
+    auto gain_data = gain.data();
+
+    double max_error = 0.0;
+    input.parallel_reduce(KOKKOS_LAMBDA(const int x, const int y, double& local_max) {
+      const double reference = Kokkos::clamp(static_cast<double>(input_data(x, y)) * reference_data(x, y),
+        static_cast<double>(min), static_cast<double>(max));
+      const T encoded = correction.gain_corrected(input_data(x, y), gain_data(x, y));
+      const double error = Kokkos::abs(static_cast<double>(static_cast<T>(reference)) - static_cast<double>(encoded));
+      if (error > local_max) local_max = error;
+    }, Kokkos::Max<double>(max_error));
+    return max_error;
+  }
+
+  template<typename T>
+  void histogram_equalisation(
+    ko::image::image_2d<T> image,
+    view<int*> histogram, 
+    view<double*> normed_histogram_working_buffer,
+    view<T*> lut_working_buffer,
+    T histo_eq_range) {
+    const size_t histogram_size = histogram.size();
+    const size_t image_size = image.element_count();
+    auto image_data = image.data();
+
+    image_policy policy({0, 0}, {image.width(), image.height()});
+
+    Kokkos::parallel_scan(
+      "ko::transforms::histogram_equalisation::parallal_scan calculating cumulative histogram", 
+      histogram_size, 
+      KOKKOS_LAMBDA(const int i, size_t& update, const bool final) {
+        update += histogram(i);
+        if (final) histogram(i) = update;
+    });
+
+    Kokkos::parallel_for(
+      "ko::transforms::histogram_equalisation::parallel_for normalising histogram",
+      histogram_size,
+      KOKKOS_LAMBDA(const int i) {
+        normed_histogram_working_buffer(i) = static_cast<float>(histogram(i)) / image_size;
+    });
+
+    Kokkos::parallel_for(
+      "ko::transforms::histogram_equalisation::parallel_for building lut",
+      histogram_size,
+      KOKKOS_LAMBDA(const int i) {
+        lut_working_buffer(i) = static_cast<T>(normed_histogram_working_buffer(i) * histo_eq_range);
+    });
+
+    Kokkos::parallel_for(
+      "ko::transforms::histogram_equalisation::parallel_for equalising image using lut",
+      policy,
+      KOKKOS_LAMBDA(const int x, const int y) {
+        image_data(x, y) = lut_working_buffer(image_data(x, y));
+    });
+  }
+
+  // Histogram equalisation with a LUT that persists between frames. update() histograms a
+  // frame and turns the cumulative histogram into the LUT in one single-team kernel, with
+  // no normalised intermediate. A non-zero smoothing blends each new LUT with the previous
+  // one. equalise() can apply the previous frame's LUT and queue the next one's build
+  // behind the apply, into a second buffer, so the frame never waits for its own LUT.
+  template<typename T>
+  class histogram_equaliser {
+    view<int*> histogram_;
+    view<float*> lut_state_;
+    view<T*> lut_;
+    view<T*> next_lut_;
+    Kokkos::DefaultExecutionSpace building_space_;
+    T min_;
+    T max_;
+    float range_;
+    float smoothing_;
+    bool primed_ = false;
+    bool building_ = false;
+
+  public:
+    histogram_equaliser(size_t bin_count, T min, T max, T range, float smoothing = 0.0f)
+      : histogram_("histogram_equaliser histogram", bin_count),
+        lut_state_("histogram_equaliser lut state", bin_count),
+        lut_("histogram_equaliser lut", bin_count),
+        next_lut_("histogram_equaliser next lut", bin_count),
+        min_(min), max_(max), range_(range), smoothing_(smoothing) {}
+
+    view<int*> histogram() const { return histogram_; }
+    view<T*> lut() const { return lut_; }
+    bool primed() const { return primed_; }
+
+    void update(const ko::image::image_2d<T> image, const Kokkos::DefaultExecutionSpace& space = {}) {
+      wait_for_lut(space);
+      ko::statistics::histogram(histogram_, image, min_, max_, space);
+      build_lut(lut_, space);
+    }
+
+    void build_lut() {
+      build_lut(lut_, Kokkos::DefaultExecutionSpace());
+    }
+
+    // Builds the LUT for histogram() into lut, queued on space.
+    void build_lut(view<T*> lut, const Kokkos::DefaultExecutionSpace& space) {
+      using team_member = typename Kokkos::TeamPolicy<>::member_type;
+      auto histogram = histogram_;
+      auto lut_state = lut_state_;
+      const int bin_count = histogram.extent(0);
+      const float range = range_;
+      const float smoothing = primed_ ? smoothing_ : 0.0f;
+
+      Kokkos::parallel_for(
+        "ko::transforms::histogram_equaliser::parallel_for building lut",
+        Kokkos::TeamPolicy<>(space, 1, Kokkos::AUTO),
+        KOKKOS_LAMBDA(const team_member& team) {
+          int total = 0;
+          Kokkos::parallel_reduce(Kokkos::TeamThreadRange(team, bin_count), [&](const int i, int& local_total) {
+            local_total += histogram(i);
+          }, total);
+
+          const float scale = total > 0 ? range / total : 0.0f;
+          Kokkos::parallel_scan(Kokkos::TeamThreadRange(team, bin_count), [&](const int i, int& update, const bool final) {
+            update += histogram(i);
+            if (final) {
+              const float value = smoothing * lut_state(i) + (1.0f - smoothing) * (update * scale);
+              lut_state(i) = value;
+              lut(i) = static_cast<T>(value);
+            }
+          });
+      });
+      primed_ = true;
+    }
+
+    // Makes a LUT build queued by equalise() current for work queued on space. Only a
+    // build on another instance is waited for; on the same instance the queue already
+    // runs it first.
+    void wait_for_lut(const Kokkos::DefaultExecutionSpace& space = {}) {
+      if (!building_) return;
+      if (!(building_space_ == space)) building_space_.fence();
+      std::swap(lut_, next_lut_);
+      building_ = false;
+    }
+
+    void apply(ko::image::image_2d<T> image, const Kokkos::DefaultExecutionSpace& space = {}) const {
+      auto data = image.data();
+      auto lut = lut_;
+      const T min = min_;
+      const T max = max_;
+      ko::statistics::histogram_binning<T> binning(min, max, lut.extent(0));
+
+      Kokkos::parallel_for(
+        "ko::transforms::histogram_equaliser::parallel_for applying lut",
+        image_policy(space, {0, 0}, {image.width(), image.height()}),
+        KOKKOS_LAMBDA(const size_t x, const size_t y) {
+          data(x, y) = lut(binning(Kokkos::clamp(data(x, y), min, max)));
+      });
+    }
+
+    // Equalises image in place, queued on space. With reuse_previous_lut the frame is
+    // mapped through the LUT built from earlier frames and the LUT it feeds is built
+    // after the apply, on the same instance. Nothing here waits for the device.
+    void equalise(ko::image::image_2d<T> image, bool reuse_previous_lut = false, const Kokkos::DefaultExecutionSpace& space = {}) {
+      if (reuse_previous_lut && primed_) {
+        wait_for_lut(space);
+        ko::statistics::histogram(histogram_, image, min_, max_, space);
+        apply(image, space);
+        build_lut(next_lut_, space);
+        building_space_ = space;
+        building_ = true;
+      } else {
+        update(image, space);
+        apply(image, space);
+      }
+    }
+  };
+
+  template<typename A, typename B, typename C>
+  KOKKOS_INLINE_FUNCTION 
+  C dot_product(view<A**> view1, view<B**> view2) {
+    const size_t width = view1.extent(0);
+    const size_t height = view1.extent(1);
+
+    C sum = 0;
+
+    Kokkos::parallel_reduce("dot_product", image_policy({0, 0}, {width, height}),
+    KOKKOS_LAMBDA(const int x, const int y, C& local_sum) {
+        local_sum += (static_cast<C>(view1(x, y)) * static_cast<C>(view2(x, y)));
+    }, sum);
+
+    return sum;
+  }
+
+  // Mean over a window_size x window_size window (window_size odd) at a cost per pixel
+  // that doesn't depend on the window: prefix sums along each row into working, then
+  // running sums along each column into output. Integer outputs are rounded and
+  // saturated. When input is a region of interest the windows read the frame around it,
+  // and working also holds the rows of input.with_halo(window_size / 2) above and below
+  // the region.
+  template<typename T, typename U>
+  void box_filter(
+    const ko::image::image_2d<T> input,
+    ko::image::image_2d<U> output,
+    ko::image::image_2d<float> working,
+    size_t window_size,
+    ko::image::border_mode border = ko::image::border_mode::valid
+  ) {
+    using sum_type = std::conditional_t<std::is_integral_v<T>, int64_t, double>;
+    using team_member = typename Kokkos::TeamPolicy<>::member_type;
+    using scratch_view = Kokkos::View<sum_type*, Kokkos::DefaultExecutionSpace::scratch_memory_space, Kokkos::MemoryTraits<Kokkos::Unmanaged>>;
+    using ko::image::border_index;
+    using ko::image::border_mode;
+
+    const int width = input.width();
+    const int height = input.height();
+    const int radius = window_size / 2;
+    const double window_scale = 1.0 / (2 * radius + 1);
+    const auto halo = input.with_halo(radius);
+    const int origin_x = input.x_offset();
+    const int origin_y = input.y_offset();
+    const int first_row = halo.y_offset();
+    const int frame_width = input.frame().extent(0);
+    const int frame_height = input.frame().extent(1);
+    auto frame_data = input.frame();
+    auto working_data = working.data();
+    auto output_data = output.data();
+
+    assert(working.width() == input.width() && working.height() == halo.height());
+
+    // One team per row: a team scan turns the row's samples into prefix sums in scratch, so
+    // neighbouring threads read neighbouring pixels, and each window is a difference of two.
+    const int span = width + 2 * radius;
+    const size_t scratch_size = scratch_view::shmem_size(span + 1);
+    const int scratch_level = scratch_size <= static_cast<size_t>(Kokkos::TeamPolicy<>::scratch_size_max(0)) ? 0 : 1;
+    Kokkos::TeamPolicy<> rows(halo.height(), Kokkos::AUTO);
+    rows.set_scratch_size(scratch_level, Kokkos::PerTeam(scratch_size));
+
+    Kokkos::parallel_for("ko::transforms::box_filter::parallel_for horizontal pass", rows, KOKKOS_LAMBDA(const team_member& team) {
+      const int row = team.league_rank();
+      const int y = first_row + row;
+      scratch_view prefix(team.team_scratch(scratch_level), span + 1);
+
+      Kokkos::parallel_scan(Kokkos::TeamThreadRange(team, span), [&](const int i, sum_type& partial, const bool final) {
+        const int fx = border_index(origin_x - radius + i, frame_width, border);
+        partial += fx < 0 ? sum_type(0) : static_cast<sum_type>(frame_data(fx, y));
+        if (final) prefix(i + 1) = partial;
+      });
+      Kokkos::single(Kokkos::PerTeam(team), [&]() { prefix(0) = 0; });
+      team.team_barrier();
+
+      Kokkos::parallel_for(Kokkos::TeamThreadRange(team, width), [&](const int x) {
+        const int fx = origin_x + x;
+        const double scale = border == border_mode::valid
+          ? 1.0 / (Kokkos::min(fx + radius, frame_width - 1) - Kokkos::max(fx - radius, 0) + 1)
+          : window_scale;
+        working_data(x, row) = static_cast<float>((prefix(x + 2 * radius + 1) - prefix(x)) * scale);
+      });
+    });
+
+    Kokkos::parallel_for("ko::transforms::box_filter::parallel_for vertical pass", width, KOKKOS_LAMBDA(const int x) {
+      auto sample = [&](const int y) -> double {
+        const int i = border_index(y, frame_height, border);
+        return i < 0 ? 0.0 : static_cast<double>(working_data(x, i - first_row));
+      };
+
+      double sum = 0.0;
+      for (int y = origin_y - radius; y <= origin_y + radius; ++y) sum += sample(y);
+
+      for (int y = 0; y < height; ++y) {
+        const int fy = origin_y + y;
+        const double scale = border == border_mode::valid
+          ? 1.0 / (Kokkos::min(fy + radius, frame_height - 1) - Kokkos::max(fy - radius, 0) + 1)
+          : window_scale;
+        output_data(x, y) = ko::maths::saturate_cast<U>(sum * scale);
+        // The row after the last window may be past the halo held in working.
+        if (y + 1 < height) sum += sample(fy + radius + 1) - sample(fy - radius);
+      }
+    });
+  }
+
+  template<typename T, typename U>
+  void box_filter(
+    const ko::image::image_2d<T> input,
+    ko::image::image_2d<U> output,
+    size_t window_size,
+    ko::image::border_mode border = ko::image::border_mode::valid
+  ) {
+    auto working = ko::image::default_frame_pool<float>().acquire(input.width(), input.with_halo(window_size / 2).height());
+    box_filter(input, output, working, window_size, border);
+  }
+
+  // Mean over the in-bounds part of each window_size x window_size window.
+  template<typename T, typename U>
+  void mean_filter(ko::image::image_2d<T> input, ko::image::image_2d<U> mean_filtered_image, size_t window_size) {
+    box_filter(input, mean_filtered_image, window_size, ko::image::border_mode::valid);
+  }
+
+  // Normalised convolution with a square kernel, e.g. a gaussian, run on the tiled
+  // stencil engine. output must not alias input.
+  template<typename T, typename U>
+  void convolve(
+    const ko::image::image_2d<T> input,
+    ko::image::image_2d<U> output,
+    view<double**> kernel,
+    ko::image::border_mode border = ko::image::border_mode::replicate
+  ) {
+    ko::stencil::apply(input, output, kernel.extent(0) / 2, ko::stencil::convolution_op{kernel}, border);
+  }
+
+  template<typename T>
+  void erode(
+    const ko::image::image_2d<T> input,
+    ko::image::image_2d<T> output,
+    size_t window_size,
+    ko::image::border_mode border = ko::image::border_mode::valid
+  ) {
+    ko::stencil::apply(input, output, window_size / 2, ko::stencil::erode_op{}, border);
+  }
+
+  template<typename T>
+  void dilate(
+    const ko::image::image_2d<T> input,
+    ko::image::image_2d<T> output,
+    size_t window_size,
+    ko::image::border_mode border = ko::image::border_mode::valid
+  ) {
+    ko::stencil::apply(input, output, window_size / 2, ko::stencil::dilate_op{}, border);
+  }
+
+  // Out of place defect correction on the stencil engine, for when input has to be kept.
+  template<typename T, typename M>
+  void defect_interpolation(
+    const ko::image::image_2d<T> input,
+    ko::image::image_2d<T> output,
+    ko::image::image_2d<M> defect_map,
+    view<double**> kernel
+  ) {
+    ko::stencil::defect_interpolation_op<M> op{defect_map.data(), kernel};
+    ko::stencil::apply(input, output, kernel.extent(0) / 2, op, ko::image::border_mode::constant);
+  }
 }
\ No newline at end of file
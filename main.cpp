@@ -1,195 +1,209 @@
-#include <Kokkos_Core.hpp>
-#include <Kokkos_Timer.hpp>
-#include <kokkos_types.hpp>
-#include <image.hpp>
-#include <statistics.hpp>
-#include <transforms.hpp>
-#include <format>
-#include <vector>
-#include <iostream>
-#include <opencv2/opencv.hpp>
-#include <chrono>
-
-using team_member = typename Kokkos::TeamPolicy<>::member_type;
-
-template<typename T, typename Layout>
-KOKKOS_INLINE_FUNCTION void mean_filter_helper(view<T*, Layout> data, size_t filter_size, float scale) {
-  size_t size = data.size();
-  int val = 0;
-
-  // do left boundary
-  val = data(0) * filter_size;
-
-  for (int x = 0; x < filter_size + 1; x++) val += data(x);
-  data(0) = val * scale;
-
-  for (int x = 1; x < filter_size + 1; ++x) {
-    val += data(x + filter_size);
-    val -= data(0);
-    data(x) = val * scale;
-  }
-
-  // main loop
-  for (int x = filter_size + 1; x < size - filter_size; x++) {
-    val += data(x + filter_size);
-    val -= data(x - filter_size - 1);
-    data(x) = val * scale;
-  }
-
-  // do right boundary
-  for (int x = size - filter_size; x < size; ++x) {
-    val += data(size - 1);
-    val -= data(x - filter_size - 1);
-    data(x) = val * scale;
-  }
-}
-
-template<typename T>
-void mean_filter(view<T**> data, size_t filter_size) {
-    float scale = 1.0f / static_cast<float>((filter_size << 1) + 1);
-
-    Kokkos::parallel_for("HorizontalMeanFilter", Kokkos::RangePolicy<>(0, data.extent(1)), KOKKOS_LAMBDA(int height) {
-      auto row_view = Kokkos::subview(data, Kokkos::ALL(), height);
-      mean_filter_helper<T, Kokkos::LayoutRight>(row_view, filter_size, scale);
-    });
-
-    // Kokkos::parallel_for("VerticalMeanFilter", Kokkos::RangePolicy<>(0, data.extent(0)), KOKKOS_LAMBDA(int width) {
-    //   auto col_view = Kokkos::subview(data, width, Kokkos::ALL());
-    //   mean_filter_helper<T, Kokkos::LayoutStride>(col_view, filter_size, scale);
-    // });
-}
-
-template<typename T>
-struct mean_filter_test {
-    view<T**> data_;
-    size_t window_size_;
-    size_t window_half_size_;
-
-    mean_filter_test(view<T**> data, size_t window_size) 
-        : data_(data), window_size_(window_size), window_half_size_(window_size / 2) {}
-
-    KOKKOS_INLINE_FUNCTION
-    void operator()(const team_member& thread) const {
-      Kokkos::parallel_for(
-        Kokkos::TeamThreadRange(thread, 32),
-        [=, *this](const int thread_idx) {
-          int idx = thread_idx * thread.league_rank() * thread.team_size();
-          int x = idx % data_.extent(0);
-          int y = idx / data_.extent(1);
-
-          int tsum = 0;
-
-          if (idx < data_.size())
-            Kokkos::single(Kokkos::PerThread(thread), [=]() { data_(x, y) = tsum / (window_size_ * window_size_); });
-        });
-    }
-
-    size_t thread_shmem_size(int team_size) const {
-        return window_size_ * window_size_ * sizeof(T);
-    }
-};
-
-ko::image::image_2d<uint16_t> image_from_path(std::string path) {
-    cv::Mat mat = cv::imread(path, cv::IMREAD_UNCHANGED);
-    view<uint16_t**> data("Test", mat.cols, mat.rows);
-    auto host_mirror = Kokkos::create_mirror_view(data);
-    std::memcpy(host_mirror.data(), mat.data, data.size() * sizeof(uint16_t));
-    Kokkos::deep_copy(data, host_mirror);
-    ko::image::image_2d<uint16_t> image(data);
-    return image;
-}
-
-template<typename T>
-void save_image(ko::image::image_2d<T> img, std::string filepath) {
-  cv::Mat_<T> cv_img(img.height(), img.width());
-  auto host_mirror = Kokkos::create_mirror_view(img.data());
-  Kokkos::deep_copy(host_mirror, img.data());
-  std::memcpy(cv_img.data, host_mirror.data(), img.element_count() * sizeof(T));
-  if (!cv::imwrite(filepath, cv_img)) {
-      throw std::runtime_error("Failed to save image: " + filepath);
-  }
-}
-
-const std::string TEST_IMAGES_DIR = "C:\\dev\\data\\Test Images\\";
-const std::string DARK_IMAGE_PATH = TEST_IMAGES_DIR + "AVG_Dark_2802_2400.tif";
-const std::string GAIN_IMAGE_PATH = TEST_IMAGES_DIR + "AVG_Gain_2802_2400.tif";
-const std::string DEFECT_IMAGE_PATH = TEST_IMAGES_DIR + "DefectMap.tif";
-const std::string PCB_IMAGE_PATH = TEST_IMAGES_DIR + "AVG_PCB_2802_2400.tif";
-
-int main(int argc, char* argv[]) {
-    Kokkos::initialize(argc, argv);
-
-    { 
-      auto test_image = image_from_path(PCB_IMAGE_PATH);
-      auto start = std::chrono::high_resolution_clock::now();
-      mean_filter<uint16_t>(test_image.data(), 5);
-      auto end = std::chrono::high_resolution_clock::now();
-      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-      std::cout << "mean took " << elapsed.count() << " microseconds.\n";
-      save_image(test_image, "new mean filter.tif");
-    }
-
-    constexpr int defect_kernel_size = 7;
-    constexpr uint16_t min = 0;
-    constexpr uint16_t max = 16383;
-    constexpr uint16_t offset = 300;
-    constexpr uint16_t histo_eq_range = 256;
-    constexpr uint16_t threshold = 750;
-    constexpr size_t histogram_size = 16384;
-    constexpr size_t mean_filter_window_size = 7;
-
-    auto pcb_image = image_from_path(PCB_IMAGE_PATH);
-    auto defect_image = image_from_path(DEFECT_IMAGE_PATH);
-    auto gain_image = image_from_path(GAIN_IMAGE_PATH);
-    auto dark_image = image_from_path(DARK_IMAGE_PATH);
-
-    view<int*> histogram("histogram", histogram_size);
-    view<double*> histogram_normed_buffer("histo normed buffer", histogram_size);
-    view<uint16_t*> lut("lut", histogram_size);
-    ko::image::image_2d<double> normed_gain(pcb_image.width(), pcb_image.height());
-    ko::image::image_2d<float> mean_filtered_image(pcb_image.width(), pcb_image.height());
-
-    ko::transforms::normalise(normed_gain, gain_image);
-
-    view<double**> kernel("kernel", defect_kernel_size, defect_kernel_size);
-    double sigma = 1.0;
-    double pi = 3.14;
-    int kernel_half_size = defect_kernel_size / 2;
-    Kokkos::parallel_for("init_gaussian_kernel", Kokkos::RangePolicy<>(0, defect_kernel_size), KOKKOS_LAMBDA(int i) {
-        for (int j = 0; j < defect_kernel_size; ++j) {
-            int x = i - kernel_half_size;
-            int y = j - kernel_half_size;
-            kernel(i, j) = std::exp(-(x * x + y * y) / (2 * sigma * sigma)) / (2 * pi * sigma * sigma);
-        }
-    });
-
-    ko::transforms::mean_filter_shared_mem<uint16_t> mean_functor(pcb_image.data(), mean_filtered_image.data(), 4);
-
-    auto comp = KOKKOS_LAMBDA(const uint16_t value) -> bool {
-        return value >= threshold;
-    };
-    
-    auto start = std::chrono::high_resolution_clock::now();
-
-    ko::transforms::dark_correction(pcb_image, dark_image, offset, min, max);
-    ko::transforms::gain_correction(pcb_image, normed_gain, min, max);
-    ko::transforms::defect_correction(pcb_image, defect_image, kernel);
-    // mean_functor.run(pcb_image.data(),  mean_filtered_image.data());
-    // ko::transforms::mean_filter(pcb_image, mean_filtered_image, mean_filter_window_size);
-    size_t count = ko::statistics::count(pcb_image, comp);
-    ko::statistics::simple_histogram(histogram, pcb_image, min, max);
-    ko::transforms::histogram_equalisation(pcb_image, histogram, histogram_normed_buffer, lut, histo_eq_range);
-
-    Kokkos::fence();
-
-    auto end = std::chrono::high_resolution_clock::now();
-    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    std::cout << "corrections took " << elapsed.count() << " microseconds.\n";
-    std::cout << std::format("Count: {}", count) << std::endl;
-
-    save_image(pcb_image, "result.tif");
-    save_image(mean_filtered_image, "mean.tif");
-
-    Kokkos::finalize();
-    return 0;
-}
+#include <Kokkos_Core.hpp>
+#include <Kokkos_Timer.hpp>
+#include <kokkos_types.hpp>
+#include <image.hpp>
+#include <statistics.hpp>
+#include <transforms.hpp>
+#include <detector.hpp>
+#include <io.hpp>
+#include <synthetic.hpp>
+#include <batch.hpp>
+#include <cstdlib>
+#include <format>
+#include <vector>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <chrono>
+#include <string>
+
+using team_member = typename Kokkos::TeamPolicy<>::member_type;
+
+template<typename T>
+struct mean_filter_test {
+    view<T**> data_;
+    size_t window_size_;
+    size_t window_half_size_;
+
+    mean_filter_test(view<T**> data, size_t window_size) 
+        : data_(data), window_size_(window_size), window_half_size_(window_size / 2) {}
+
+    KOKKOS_INLINE_FUNCTION
+    void operator()(const team_member& thread) const {
+      Kokkos::parallel_for(
+        Kokkos::TeamThreadRange(thread, 32),
+        [=, *this](const int thread_idx) {
+          int idx = thread_idx * thread.league_rank() * thread.team_size();
+          int x = idx % data_.extent(0);
+          int y = idx / data_.extent(1);
+
+          int tsum = 0;
+
+          if (idx < data_.size())
+            Kokkos::single(Kokkos::PerThread(thread), [=]() { data_(x, y) = tsum / (window_size_ * window_size_); });
+        });
+    }
+
+    size_t thread_shmem_size(int team_size) const {
+        return window_size_ * window_size_ * sizeof(T);
+    }
+};
+
+const std::string TEST_IMAGES_DIR = "C:\\dev\\data\\Test Images\\";
+const std::string DARK_IMAGE_PATH = TEST_IMAGES_DIR + "AVG_Dark_2802_2400.tif";
+const std::string GAIN_IMAGE_PATH = TEST_IMAGES_DIR + "AVG_Gain_2802_2400.tif";
+const std::string DEFECT_IMAGE_PATH = TEST_IMAGES_DIR + "DefectMap.tif";
+const std::string PCB_IMAGE_PATH = TEST_IMAGES_DIR + "AVG_PCB_2802_2400.tif";
+
+// Runs the correction chain on synthetic frames at fps and reports drops and latency, so
+// throughput can be measured without the test images.
+void run_synthetic(double fps, size_t frames) {
+    ko::synthetic::frame_source<uint16_t> source;
+    ko::detector::detector_settings<uint16_t> settings{.offset = 300, .min = 0, .max = 16383};
+    ko::detector::calibrated_detector<uint16_t> detector(source.dark_frame(), source.gain_frame(), source.defect_map(), settings);
+    ko::image::image_2d<uint16_t> frame(source.width(), source.height());
+    ko::image::image_2d<float> mean_filtered_image(source.width(), source.height());
+
+    auto comp = KOKKOS_LAMBDA(const uint16_t value) -> bool {
+        return value >= 750;
+    };
+
+    auto report = ko::synthetic::run_paced(source, frame, fps, frames, [&](ko::image::image_2d<uint16_t> image) {
+        detector.correct(image);
+        ko::transforms::mean_filter(image, mean_filtered_image, 7);
+        ko::statistics::count(image, comp);
+        detector.equalise(image);
+    });
+
+    std::cout << std::format("{} fps: {} of {} frames processed, {} dropped, latency p50 {:.2f} ms, p99 {:.2f} ms, max {:.2f} ms",
+        report.fps, report.processed, report.frames, report.dropped, report.p50_ms, report.p99_ms, report.max_ms) << std::endl;
+}
+
+// GPUImage --batch <directory | list.txt | frame> --dark <path> --gain <path> --defects <path>
+//          --output <directory> [--log <timing.csv>] [--equalise]
+int run_batch(int argc, char* argv[]) {
+    ko::batch::batch_settings settings;
+    settings.detector = {.offset = 300, .min = 0, .max = 16383};
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--batch") settings.inputs = ko::batch::collect_inputs(value());
+        else if (arg == "--dark") settings.dark_path = value();
+        else if (arg == "--gain") settings.gain_path = value();
+        else if (arg == "--defects") settings.defect_path = value();
+        else if (arg == "--output") settings.output_dir = value();
+        else if (arg == "--log") settings.timing_log = value();
+        else if (arg == "--equalise") settings.equalise = true;
+        else throw std::runtime_error("Unknown argument " + arg);
+    }
+    if (settings.dark_path.empty() || settings.gain_path.empty() || settings.defect_path.empty() || settings.output_dir.empty()) {
+        throw std::runtime_error("--batch needs --dark, --gain, --defects and --output");
+    }
+
+    auto report = ko::batch::run_batch(settings);
+    std::cout << std::format("{} frames processed, {} failed, {} written, {} write failures, {} writer stalls in {:.2f} s ({:.1f} fps)",
+        report.processed, report.failed, report.writes.written, report.writes.failed, report.writes.stalls,
+        report.seconds, report.processed / report.seconds) << std::endl;
+    return report.failed == 0 && report.writes.failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    Kokkos::initialize(argc, argv);
+
+    if (argc > 1 && std::string(argv[1]) == "--batch") {
+        int status;
+        try {
+            status = run_batch(argc, argv);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            status = 2;
+        }
+        Kokkos::finalize();
+        return status;
+    }
+
+    // GPUImage --synthetic [fps] [frames]
+    if (argc > 1 && std::string(argv[1]) == "--synthetic") {
+        int status = 0;
+        try {
+            const double fps = argc > 2 ? std::stod(argv[2]) : 30.0;
+            const size_t frames = argc > 3 ? std::stoull(argv[3]) : 300;
+            run_synthetic(fps, frames);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            status = 2;
+        }
+        Kokkos::finalize();
+        return status;
+    }
+
+    { 
+      auto test_image = ko::io::read_image(PCB_IMAGE_PATH);
+      ko::image::image_2d<uint16_t> filtered_image(test_image.width(), test_image.height());
+      ko::image::image_2d<float> working(test_image.width(), test_image.height());
+      auto start = std::chrono::high_resolution_clock::now();
+      ko::transforms::box_filter(test_image, filtered_image, working, 11, ko::image::border_mode::replicate);
+      Kokkos::fence();
+      auto end = std::chrono::high_resolution_clock::now();
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+      std::cout << "mean took " << elapsed.count() << " microseconds.\n";
+      ko::io::save_image(filtered_image, "new mean filter.tif");
+    }
+
+    constexpr int defect_kernel_size = 7;
+    constexpr uint16_t min = 0;
+    constexpr uint16_t max = 16383;
+    constexpr uint16_t offset = 300;
+    constexpr uint16_t histo_eq_range = 256;
+    constexpr uint16_t threshold = 750;
+    constexpr size_t histogram_size = 16384;
+    constexpr size_t mean_filter_window_size = 7;
+
+    auto pcb_image = ko::io::read_image(PCB_IMAGE_PATH);
+    auto gain_image = ko::io::read_image(GAIN_IMAGE_PATH);
+
+    ko::detector::detector_settings<uint16_t> settings{
+      .offset = offset,
+      .min = min,
+      .max = max,
+      .defect_kernel_size = defect_kernel_size,
+      .histogram_size = histogram_size,
+      .equalisation_range = histo_eq_range
+    };
+    ko::detector::calibrated_detector<uint16_t> detector(
+      ko::io::read_image(DARK_IMAGE_PATH), gain_image, ko::io::read_image(DEFECT_IMAGE_PATH), settings);
+    ko::image::image_2d<float> mean_filtered_image(pcb_image.width(), pcb_image.height());
+
+    {
+      ko::image::image_2d<double> reference_gain(pcb_image.width(), pcb_image.height());
+      ko::transforms::normalise(reference_gain, gain_image);
+      double error = ko::transforms::gain_encoding_error(pcb_image, reference_gain, detector.gain(), min, max);
+      std::cout << std::format("float gain max error: {}", error) << std::endl;
+    }
+
+    auto comp = KOKKOS_LAMBDA(const uint16_t value) -> bool {
+        return value >= threshold;
+    };
+    
+    auto start = std::chrono::high_resolution_clock::now();
+
+    detector.correct(pcb_image);
+    ko::transforms::mean_filter(pcb_image, mean_filtered_image, mean_filter_window_size);
+    size_t count = ko::statistics::count(pcb_image, comp);
+    detector.equalise(pcb_image);
+
+    Kokkos::fence();
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    std::cout << "corrections took " << elapsed.count() << " microseconds.\n";
+    std::cout << std::format("Count: {}", count) << std::endl;
+
+    ko::io::save_image(pcb_image, "result.tif");
+    ko::io::save_image(mean_filtered_image, "mean.tif");
+
+    Kokkos::finalize();
+    return 0;
+}
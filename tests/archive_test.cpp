@@ -0,0 +1,76 @@
+#include <Kokkos_Core.hpp>
+#include <archive.hpp>
+#include "test_support.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+  using ko::test::check;
+  using ko::test::check_throws;
+
+  template<typename T>
+  void round_trip(const std::string& path, size_t width, size_t height, int bit_depth, ko::io::archive_options options) {
+    const std::string name = path + " " + std::to_string(width) + "x" + std::to_string(height);
+    std::vector<std::vector<T>> frames;
+    for (uint32_t i = 0; i < 3; ++i) frames.push_back(ko::test::test_image<T>(width, height, width, (1u << bit_depth) - 1, i + 1));
+    {
+      ko::io::archive_writer<T> writer(path, width, height, bit_depth, options);
+      for (const auto& frame : frames) writer.write(frame.data(), width);
+    }
+
+    ko::io::archive_reader<T> reader(path);
+    check(reader.width() == width && reader.height() == height, name + ": dimensions");
+    check(reader.bit_depth() == static_cast<size_t>(bit_depth), name + ": bit depth");
+    check(reader.frame_count() == frames.size(), name + ": frame count");
+    // Out of order, to go through the index.
+    for (size_t i : {2, 0, 1}) {
+      std::vector<T> decoded(width * height);
+      reader.read(i, decoded.data(), width);
+      check(decoded == frames[i], name + ": frame " + std::to_string(i) + " round trip");
+    }
+    check_throws<std::out_of_range>([&] { reader.compressed_bytes(frames.size()); }, name + ": frame index past the end");
+  }
+
+  void rejects_empty_frames(const std::string& path) {
+    check_throws<std::invalid_argument>([&] { ko::io::archive_writer<uint16_t> writer(path, 0, 16); }, "zero width archive");
+    check_throws<std::invalid_argument>([&] { ko::io::archive_writer<uint16_t> writer(path, 16, 0); }, "zero height archive");
+    check_throws<std::invalid_argument>([&] { ko::io::archive_writer<uint16_t> writer(path, 16, 16, 16, {0, 8}); }, "zero width tiles");
+  }
+
+  void rejects_zero_tiles(const std::string& path) {
+    {
+      ko::io::archive_writer<uint8_t> writer(path, 8, 8);
+      std::vector<uint8_t> frame(64, 1);
+      writer.write(frame.data(), 8);
+    }
+    {
+      std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+      const uint32_t zero = 0;
+      file.seekp(offsetof(ko::io::archive_header, tile_width));
+      file.write(reinterpret_cast<const char*>(&zero), sizeof(zero));
+    }
+    check_throws<std::runtime_error>([&] { ko::io::archive_reader<uint8_t> reader(path); }, "archive with zero width tiles");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Kokkos::ScopeGuard kokkos(argc, argv);
+  const auto dir = std::filesystem::temp_directory_path();
+  const std::string path = (dir / "ko_archive_test.koa").string();
+
+  round_trip<uint16_t>(path, 300, 200, 12, {});
+  round_trip<uint16_t>(path, 64, 64, 16, {16, 16});
+  round_trip<uint16_t>(path, 37, 5, 16, {128, 64});
+  round_trip<uint8_t>(path, 129, 65, 8, {});
+  round_trip<uint8_t>(path, 1, 1, 8, {});
+  rejects_empty_frames(path);
+  rejects_zero_tiles(path);
+
+  std::filesystem::remove(path);
+  return ko::test::result("archive_test");
+}
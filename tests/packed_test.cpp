@@ -0,0 +1,92 @@
+#include <Kokkos_Core.hpp>
+#include <packed.hpp>
+#include "test_support.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace {
+  using ko::test::check;
+
+  // Reference packer, one bit at a time: each row starts on a byte boundary and its
+  // pixels follow least significant bit first.
+  std::vector<uint8_t> pack_reference(const std::vector<uint16_t>& pixels, size_t width, size_t height, unsigned bits) {
+    const size_t row_bytes = ko::packed::packed_frame::row_bytes(width, bits);
+    std::vector<uint8_t> packed(row_bytes * height, 0);
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        for (unsigned b = 0; b < bits; ++b) {
+          const size_t bit = x * bits + b;
+          if ((pixels[y * width + x] >> b) & 1) packed[y * row_bytes + bit / 8] |= uint8_t(1u << (bit % 8));
+        }
+      }
+    }
+    return packed;
+  }
+
+  ko::image::image_2d<uint16_t> device_image(const std::vector<uint16_t>& pixels, size_t width, size_t height) {
+    ko::image::image_2d<uint16_t> image(width, height);
+    auto host = Kokkos::create_mirror_view(image.data());
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) host(x, y) = pixels[y * width + x];
+    }
+    Kokkos::deep_copy(image.data(), host);
+    return image;
+  }
+
+  bool matches(const ko::image::image_2d<uint16_t>& image, const std::vector<uint16_t>& pixels) {
+    auto host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), image.data());
+    for (size_t y = 0; y < image.height(); ++y) {
+      for (size_t x = 0; x < image.width(); ++x) {
+        if (host(x, y) != pixels[y * image.width() + x]) return false;
+      }
+    }
+    return true;
+  }
+
+  void round_trip(size_t width, size_t height, unsigned bits) {
+    const std::string what = std::to_string(width) + "x" + std::to_string(height) + " at " + std::to_string(bits) + " bits";
+    const auto pixels = ko::test::test_image<uint16_t>(width, height, width, (1u << bits) - 1, width * 31 + bits);
+    const auto reference = pack_reference(pixels, width, height, bits);
+
+    bool extracted = true;
+    const size_t row_bytes = ko::packed::packed_frame::row_bytes(width, bits);
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        extracted = extracted && ko::packed::extract(reference.data() + y * row_bytes, x, bits) == pixels[y * width + x];
+      }
+    }
+    check(extracted, what + ": extract");
+
+    ko::packed::packed_frame frame(width, height, bits);
+    frame.upload(reference.data());
+    ko::image::image_2d<uint16_t> unpacked(width, height);
+    ko::packed::unpack(frame, unpacked);
+    check(matches(unpacked, pixels), what + ": unpack");
+
+    ko::image::image_2d<uint16_t> fused(width, height);
+    fused = ko::packed::unpacked(frame);
+    check(matches(fused, pixels), what + ": unpacked() against unpack");
+
+    // Pack into a frame whose bytes are all set, so bits past the last pixel of a row
+    // that pack didn't clear show up against the reference.
+    ko::packed::packed_frame repacked(width, height, bits);
+    Kokkos::deep_copy(repacked.bytes(), uint8_t(0xff));
+    ko::packed::pack(device_image(pixels, width, height), repacked);
+    std::vector<uint8_t> bytes(repacked.size_bytes());
+    repacked.download(bytes.data());
+    check(bytes == reference, what + ": pack");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Kokkos::ScopeGuard kokkos(argc, argv);
+
+  for (unsigned bits : {8u, 10u, 12u, 14u, 16u}) {
+    // Widths that end part way through a pixel group as well as on a boundary.
+    for (size_t width : {1, 3, 5, 7, 8, 13, 64}) round_trip(width, 9, bits);
+  }
+
+  return ko::test::result("packed_test");
+}
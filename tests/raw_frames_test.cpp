@@ -0,0 +1,114 @@
+#include <Kokkos_Core.hpp>
+#include <raw_frames.hpp>
+#include "test_support.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+  using ko::test::check;
+  using ko::test::check_throws;
+
+  template<typename T>
+  ko::image::image_2d<T> device_image(const std::vector<T>& pixels, size_t width, size_t height) {
+    ko::image::image_2d<T> image(width, height);
+    auto host = Kokkos::create_mirror_view(image.data());
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) host(x, y) = pixels[y * width + x];
+    }
+    Kokkos::deep_copy(image.data(), host);
+    return image;
+  }
+
+  template<typename V, typename T>
+  bool matches(const V& frame, const std::vector<T>& pixels, size_t width, size_t height) {
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        if (frame(x, y) != pixels[y * width + x]) return false;
+      }
+    }
+    return true;
+  }
+
+  template<typename T>
+  void round_trip(const std::string& path, size_t width, size_t height, uint32_t bit_depth) {
+    const std::string what = std::to_string(bit_depth) + "-bit raw frames";
+    std::vector<std::vector<T>> frames;
+    for (uint32_t i = 0; i < 3; ++i) frames.push_back(ko::test::test_image<T>(width, height, width, (1u << bit_depth) - 1, i + 1));
+    {
+      ko::io::raw_frame_writer<T> writer(path, width, height, bit_depth);
+      for (const auto& frame : frames) writer.write(device_image(frame, width, height));
+      // A region of a larger image isn't contiguous and has to be packed on the way out.
+      ko::image::image_2d<T> padded(width + 4, height + 2);
+      Kokkos::deep_copy(padded.data(), T(0));
+      Kokkos::deep_copy(padded.roi(2, 1, width, height).data(), device_image(frames[0], width, height).data());
+      writer.write(padded.roi(2, 1, width, height));
+      check(writer.frame_count() == 4, what + ": frames written");
+    }
+
+    ko::io::raw_frame_reader<T> reader(path);
+    check(reader.width() == width && reader.height() == height && reader.bit_depth() == bit_depth, what + ": header");
+    check(reader.frame_count() == 4, what + ": frame count");
+    for (size_t i : {2, 0, 1, 3}) {
+      check(matches(reader.frame(i), frames[i % 3], width, height), what + ": mapped frame " + std::to_string(i));
+    }
+    ko::image::image_2d<T> image(width, height);
+    reader.read_frame(1, image);
+    auto host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), image.data());
+    check(matches(host, frames[1], width, height), what + ": read_frame");
+    check_throws<std::out_of_range>([&] { reader.frame(4); }, what + ": frame index past the end");
+  }
+
+  // A valid one frame file with header fields overridden by edit, optionally cut short.
+  void write_file(const std::string& path, void (*edit)(ko::io::raw_header&), size_t cut = 0) {
+    ko::io::raw_header header{};
+    std::memcpy(header.magic, ko::io::raw_magic, sizeof(ko::io::raw_magic));
+    header.version = ko::io::raw_version;
+    header.header_size = sizeof(ko::io::raw_header);
+    header.width = 8;
+    header.height = 4;
+    header.bit_depth = 16;
+    header.frame_count = 1;
+    edit(header);
+    std::vector<std::byte> bytes(sizeof(header) + 8 * 4 * sizeof(uint16_t) + 8);
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    bytes.resize(bytes.size() - cut);
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  }
+
+  void rejects_bad_headers(const std::string& path) {
+    using header = ko::io::raw_header;
+    write_file(path, [](header&) {});
+    check(ko::io::raw_frame_reader<uint16_t>(path).frame_count() == 1, "hand written raw file");
+
+    auto rejects = [&](void (*edit)(header&), size_t cut, const std::string& what) {
+      write_file(path, edit, cut);
+      check_throws<std::runtime_error>([&] { ko::io::raw_frame_reader<uint16_t> reader(path); }, what);
+    };
+    rejects([](header& h) { h.magic[0] = 'X'; }, 0, "raw file with a bad magic");
+    rejects([](header& h) { h.header_size = 16; }, 0, "raw header size smaller than the header");
+    rejects([](header& h) { h.header_size = 41; }, 0, "raw header size that misaligns the frames");
+    rejects([](header& h) { h.header_size = 1 << 20; }, 0, "raw header size past the end of the file");
+    rejects([](header&) {}, 16, "truncated raw file");
+    rejects([](header& h) { h.frame_count = UINT64_MAX / 8; }, 0, "raw frame count that would overflow the size check");
+    rejects([](header& h) { h.bit_depth = 8; }, 0, "raw bit depth that doesn't match the element type");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Kokkos::ScopeGuard kokkos(argc, argv);
+  const std::string path = (std::filesystem::temp_directory_path() / "ko_raw_frames_test.raw").string();
+
+  round_trip<uint16_t>(path, 61, 33, 12);
+  round_trip<uint16_t>(path, 16, 16, 16);
+  round_trip<uint8_t>(path, 47, 5, 8);
+  rejects_bad_headers(path);
+
+  std::filesystem::remove(path);
+  return ko::test::result("raw_frames_test");
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Checks and fixtures shared by the tests. A test runs every check, counts the failures and
+// returns ko::test::result() from main.
+namespace ko::test {
+  inline int failures = 0;
+
+  inline void check(bool condition, const std::string& what) {
+    if (!condition) {
+      std::fprintf(stderr, "FAILED: %s\n", what.c_str());
+      failures += 1;
+    }
+  }
+
+  template<typename E, typename F>
+  void check_throws(F f, const std::string& what) {
+    try {
+      f();
+    } catch (const E&) {
+      return;
+    } catch (...) {
+    }
+    check(false, what);
+  }
+
+  inline int result(const char* name) {
+    if (failures == 0) std::printf("%s passed\n", name);
+    return failures == 0 ? 0 : 1;
+  }
+
+  // width x height pixels up to max, pitch elements between rows: smooth ramps with a
+  // little noise, every seventh row a constant run, and scattered 0 / max steps so some
+  // blocks need every bit.
+  template<typename T>
+  std::vector<T> test_image(size_t width, size_t height, size_t pitch, uint32_t max, uint32_t seed = 1) {
+    std::vector<T> image(pitch * height);
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        seed = seed * 1664525u + 1013904223u;
+        uint32_t value = (x * 5 + y * 3) % (max + 1) + (seed >> 29);
+        if (y % 7 == 3) value = y % (max + 1);
+        if ((x + y) % 61 == 0) value = (x % 2) ? max : 0;
+        image[y * pitch + x] = static_cast<T>(value > max ? max : value);
+      }
+    }
+    return image;
+  }
+}
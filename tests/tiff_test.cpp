@@ -0,0 +1,207 @@
+#include <tiff.hpp>
+#include <thread_pool.hpp>
+#include <opencv2/opencv.hpp>
+#include <zlib.h>
+#include "test_support.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace {
+  using ko::test::check;
+
+  template<typename T>
+  std::vector<T> test_image(size_t width, size_t height, size_t pitch) {
+    return ko::test::test_image<T>(width, height, pitch, std::numeric_limits<T>::max());
+  }
+
+  template<typename V>
+  void put(std::vector<std::byte>& out, size_t at, V value) {
+    std::memcpy(out.data() + at, &value, sizeof(V));
+  }
+
+  // A little-endian, 16-bit tiled TIFF of source written by hand, since write_tiff only
+  // writes strips. Edge tiles are padded to the full tile size as the spec asks, with
+  // values the reader has to ignore.
+  std::vector<std::byte> tiled_tiff(const std::vector<uint16_t>& source, uint32_t width, uint32_t height, uint32_t tile,
+                                    bool deflate) {
+    const uint32_t across = (width + tile - 1) / tile;
+    const uint32_t down = (height + tile - 1) / tile;
+    std::vector<std::vector<std::byte>> tiles;
+    for (uint32_t ty = 0; ty < down; ++ty) {
+      for (uint32_t tx = 0; tx < across; ++tx) {
+        std::vector<uint16_t> samples(tile * tile, 0xBEEF);
+        for (uint32_t y = 0; y < tile && ty * tile + y < height; ++y) {
+          for (uint32_t x = 0; x < tile && tx * tile + x < width; ++x) samples[y * tile + x] = source[(ty * tile + y) * width + tx * tile + x];
+        }
+        if (deflate) {
+          for (uint32_t y = 0; y < tile; ++y) ko::io::tiff_detail::apply_predictor(samples.data() + y * tile, tile);
+        }
+        std::vector<std::byte> bytes(samples.size() * sizeof(uint16_t));
+        std::memcpy(bytes.data(), samples.data(), bytes.size());
+        if (deflate) {
+          uLongf size = compressBound(bytes.size());
+          std::vector<std::byte> packed(size);
+          compress(reinterpret_cast<Bytef*>(packed.data()), &size, reinterpret_cast<const Bytef*>(bytes.data()), bytes.size());
+          packed.resize(size);
+          bytes = std::move(packed);
+        }
+        tiles.push_back(std::move(bytes));
+      }
+    }
+
+    struct entry { uint16_t tag, type; uint32_t count, value; };
+    const uint32_t n = tiles.size();
+    const uint32_t entry_count = deflate ? 11 : 10;
+    const uint32_t tables = 8 + 2 + 12 * entry_count + 4;
+    const uint32_t offsets_at = tables;
+    const uint32_t counts_at = tables + 4 * n;
+    uint32_t data_at = counts_at + 4 * n;
+    std::vector<entry> entries = {
+      {256, 4, 1, width}, {257, 4, 1, height}, {258, 3, 1, 16}, {259, 3, 1, deflate ? 8u : 1u}, {262, 3, 1, 1}, {277, 3, 1, 1},
+    };
+    if (deflate) entries.push_back({317, 3, 1, 2});
+    entries.push_back({322, 4, 1, tile});
+    entries.push_back({323, 4, 1, tile});
+    entries.push_back({324, 4, n, n == 1 ? data_at : offsets_at});
+    entries.push_back({325, 4, n, n == 1 ? uint32_t(tiles[0].size()) : counts_at});
+
+    std::vector<std::byte> out(data_at);
+    for (const auto& t : tiles) out.resize(out.size() + t.size());
+    std::memcpy(out.data(), "II", 2);
+    put<uint16_t>(out, 2, 42);
+    put<uint32_t>(out, 4, 8);
+    put<uint16_t>(out, 8, static_cast<uint16_t>(entries.size()));
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const size_t at = 10 + 12 * i;
+      put(out, at, entries[i].tag);
+      put(out, at + 2, entries[i].type);
+      put(out, at + 4, entries[i].count);
+      if (entries[i].type == 3 && entries[i].count == 1) {
+        put<uint16_t>(out, at + 8, static_cast<uint16_t>(entries[i].value));
+      } else {
+        put(out, at + 8, entries[i].value);
+      }
+    }
+    put<uint32_t>(out, 10 + 12 * entries.size(), 0);
+    for (uint32_t i = 0; i < n; ++i) {
+      put<uint32_t>(out, offsets_at + 4 * i, data_at);
+      put<uint32_t>(out, counts_at + 4 * i, static_cast<uint32_t>(tiles[i].size()));
+      std::memcpy(out.data() + data_at, tiles[i].data(), tiles[i].size());
+      data_at += tiles[i].size();
+    }
+    return out;
+  }
+
+  // Tiled input, with partial tiles on the right and bottom edges.
+  void reads_tiles(const std::string& path, ko::concurrency::thread_pool& pool, bool deflate) {
+    const uint32_t width = 70;
+    const uint32_t height = 37;
+    const std::string what = std::string("tiled ") + (deflate ? "deflate with predictor" : "uncompressed");
+    const auto source = test_image<uint16_t>(width, height, width);
+    const auto file = tiled_tiff(source, width, height, 32, deflate);
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(reinterpret_cast<const char*>(file.data()), file.size());
+
+    ko::io::tiff_reader reader(path);
+    const auto page = reader.page();
+    check(page.tiled && page.chunk_width == 32 && page.chunk_height == 32 && page.offsets.size() == 6, what + ": page layout");
+    std::vector<uint16_t> decoded(width * height);
+    reader.read(page, decoded.data(), width, pool);
+    check(decoded == source, what + ": decoded");
+    std::vector<uint16_t> serial(width * height);
+    reader.read(page, serial.data(), width);
+    check(serial == source, what + ": decoded on the calling thread");
+  }
+
+  const char* name(ko::io::tiff_compression compression) {
+    switch (compression) {
+      case ko::io::tiff_compression::none: return "none";
+      case ko::io::tiff_compression::deflate: return "deflate";
+      case ko::io::tiff_compression::packbits: return "packbits";
+    }
+    return "?";
+  }
+
+  // Encodes with write_tiff and decodes with tiff_reader into a wider pitch than the source.
+  template<typename T>
+  void round_trip(const std::string& path, ko::concurrency::thread_pool& pool, ko::io::tiff_compression compression,
+                  bool predictor, size_t rows_per_strip) {
+    const size_t width = 173;
+    const size_t height = 91;
+    const std::string what = std::to_string(8 * sizeof(T)) + "-bit " + name(compression) + (predictor ? " with predictor" : "") +
+                             ", " + std::to_string(rows_per_strip) + " rows per strip";
+    const auto source = test_image<T>(width, height, width + 3);
+    ko::io::write_tiff(path, source.data(), width, height, width + 3, pool, {compression, predictor, 6, rows_per_strip});
+
+    ko::io::tiff_reader reader(path);
+    const auto page = reader.page();
+    check(page.width == width && page.height == height && page.bits == 8 * sizeof(T), what + ": page layout");
+    check(page.compression == compression, what + ": compression tag");
+
+    const size_t pitch = width + 5;
+    std::vector<T> decoded(pitch * height, T(7));
+    reader.read(page, decoded.data(), pitch, pool);
+    bool same = true;
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < pitch; ++x) {
+        const T expected = x < width ? source[y * (width + 3) + x] : T(7);
+        same = same && decoded[y * pitch + x] == expected;
+      }
+    }
+    check(same, what + ": round trip");
+  }
+
+  // OpenCV's decoder must read what write_tiff writes, and tiff_reader must read what
+  // OpenCV writes, pixel for pixel.
+  void matches_opencv(const std::string& path, ko::concurrency::thread_pool& pool) {
+    const size_t width = 200;
+    const size_t height = 120;
+    const auto source = test_image<uint16_t>(width, height, width);
+
+    ko::io::write_tiff(path, source.data(), width, height, width, pool, {ko::io::tiff_compression::deflate, true});
+    const cv::Mat decoded = cv::imread(path, cv::IMREAD_UNCHANGED);
+    bool same = decoded.type() == cv::DataType<uint16_t>::type && decoded.cols == int(width) && decoded.rows == int(height);
+    for (size_t y = 0; same && y < height; ++y) {
+      const uint16_t* row = decoded.ptr<uint16_t>(static_cast<int>(y));
+      for (size_t x = 0; x < width; ++x) same = same && row[x] == source[y * width + x];
+    }
+    check(same, "write_tiff output decoded by OpenCV");
+
+    const cv::Mat reference(height, width, cv::DataType<uint16_t>::type, const_cast<uint16_t*>(source.data()));
+    for (int compression : {1, 8, 32773}) {
+      cv::imwrite(path, reference, {cv::IMWRITE_TIFF_COMPRESSION, compression});
+      ko::io::tiff_reader reader(path);
+      const auto page = reader.page();
+      std::vector<uint16_t> ours(width * height);
+      reader.read(page, ours.data(), width, pool);
+      check(ours == source, "OpenCV TIFF with compression " + std::to_string(compression) + " decoded by tiff_reader");
+    }
+  }
+}
+
+int main() {
+  const std::string path = (std::filesystem::temp_directory_path() / "ko_tiff_test.tif").string();
+  ko::concurrency::thread_pool pool(4);
+
+  using ko::io::tiff_compression;
+  for (auto compression : {tiff_compression::none, tiff_compression::deflate, tiff_compression::packbits}) {
+    for (bool predictor : {false, true}) {
+      for (size_t rows_per_strip : {size_t(0), size_t(16)}) {
+        round_trip<uint8_t>(path, pool, compression, predictor, rows_per_strip);
+        round_trip<uint16_t>(path, pool, compression, predictor, rows_per_strip);
+      }
+    }
+  }
+  matches_opencv(path, pool);
+
+  reads_tiles(path, pool, false);
+  reads_tiles(path, pool, true);
+
+  std::filesystem::remove(path);
+  return ko::test::result("tiff_test");
+}